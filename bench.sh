@@ -0,0 +1,47 @@
+#!/bin/sh
+# Build an optimized, instrumented binary, check it against the reference
+# outputs in tests/, then benchmark it.
+#
+# usage: ./bench.sh [trace...]
+# Without arguments a set of synthetic workloads is generated and run.
+
+gcc -O2 -DNDEBUG -DBENCH -pthread main.c -o bench.out || exit 1
+
+# Correctness gate: same binary, same build flags
+for in_file in tests/in/*.in; do
+    name=$(basename "$in_file" .in)
+    ./bench.out "$in_file" bench_output.txt 2> /dev/null
+    if ! diff -Z bench_output.txt "tests/out/$name.py.out" > /dev/null; then
+        echo "FAILED: $name (output left in bench_output.txt)"
+        exit 1
+    fi
+done
+echo "Correctness gate passed"
+
+run_trace() {
+    echo
+    echo "== $1"
+    ./bench.out "$2" /dev/null
+}
+
+if [ $# -gt 0 ]; then
+    for trace in "$@"; do
+        run_trace "$trace" "$trace"
+    done
+else
+    work_dir=$(mktemp -d)
+    trap 'rm -rf "$work_dir"' EXIT
+
+    gen() {
+        name=$1; shift
+        python3 bench/gen_workload.py "$@" > "$work_dir/$name.in"
+        run_trace "$name ($*)" "$work_dir/$name.in"
+    }
+
+    gen uniform      --ops 1000000 --entities 20000  --relations 20  --skew 0
+    gen hubs         --ops 1000000 --entities 20000  --relations 20  --skew 1.2
+    gen wide         --ops 1000000 --entities 5000   --relations 500 --skew 0.8
+    gen delete-heavy --ops 1000000 --entities 20000  --relations 20  --skew 1 \
+                     --delete-ratio 0.45 --churn-ratio 0.1
+    gen sorted-names --ops 1000000 --entities 100000 --relations 10  --skew 0.5 --sorted-names
+fi
@@ -0,0 +1,92 @@
+#!/usr/bin/env python3
+"""Synthetic workload generator for apinet.
+
+Emits a trace of addent/delent/addrel/delrel/report commands (terminated by
+`end`) on stdout. Entities are all created up front, then commands are drawn
+according to the given mix. Receiving (and, to a lesser extent, transmitting)
+entities are picked from a Zipf-like distribution, so that a few hubs gather
+most of the edges when --skew is high.
+"""
+
+import argparse
+import bisect
+import itertools
+import random
+import sys
+
+
+def parse_args():
+    parser = argparse.ArgumentParser(description=__doc__,
+                                     formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('--ops', type=int, default=100000,
+                        help='number of commands after the initial entity creation')
+    parser.add_argument('--entities', type=int, default=1000, help='number of distinct entity names')
+    parser.add_argument('--relations', type=int, default=10, help='number of relation types')
+    parser.add_argument('--skew', type=float, default=1.0,
+                        help='Zipf exponent for rx entity popularity (0 is uniform)')
+    parser.add_argument('--delete-ratio', type=float, default=0.2,
+                        help='fraction of relation (and entity churn) commands that are deletions')
+    parser.add_argument('--churn-ratio', type=float, default=0.02,
+                        help='fraction of commands that are addent/delent')
+    parser.add_argument('--report-ratio', type=float, default=0.05,
+                        help='fraction of commands that are reports')
+    parser.add_argument('--sorted-names', action='store_true',
+                        help='create entities in increasing name order')
+    parser.add_argument('--seed', type=int, default=0)
+    return parser.parse_args()
+
+
+def zipf_cum_weights(count, skew):
+    return list(itertools.accumulate(1.0 / (rank + 1) ** skew for rank in range(count)))
+
+
+def main():
+    args = parse_args()
+    rng = random.Random(args.seed)
+    out = []
+
+    names = ['ent_%07d' % i for i in range(args.entities)]
+    creation_order = list(names)
+    if not args.sorted_names:
+        rng.shuffle(creation_order)
+    for name in creation_order:
+        out.append('addent "%s"\n' % name)
+
+    relations = ['rel_%03d' % i for i in range(args.relations)]
+
+    # Popularity ranks are shuffled so that hubs are not simply the first names
+    rx_ranked = list(names)
+    rng.shuffle(rx_ranked)
+    rx_cum = zipf_cum_weights(len(rx_ranked), args.skew)
+    tx_cum = zipf_cum_weights(len(names), args.skew / 2)
+
+    def pick(ranked, cum):
+        return ranked[bisect.bisect_left(cum, rng.random() * cum[-1])]
+
+    added_edges = []
+    for _ in range(args.ops):
+        roll = rng.random()
+        if roll < args.report_ratio:
+            out.append('report\n')
+        elif roll < args.report_ratio + args.churn_ratio:
+            verb = 'delent' if rng.random() < args.delete_ratio else 'addent'
+            out.append('%s "%s"\n' % (verb, rng.choice(names)))
+        elif rng.random() < args.delete_ratio and added_edges:
+            # Delete a previously added edge (which may be gone already)
+            tx, rx, rel = added_edges[rng.randrange(len(added_edges))]
+            out.append('delrel "%s" "%s" "%s"\n' % (tx, rx, rel))
+        else:
+            edge = (pick(names, tx_cum), pick(rx_ranked, rx_cum), rng.choice(relations))
+            added_edges.append(edge)
+            out.append('addrel "%s" "%s" "%s"\n' % edge)
+
+        if len(out) >= 65536:
+            sys.stdout.write(''.join(out))
+            out.clear()
+
+    out.append('report\nend\n')
+    sys.stdout.write(''.join(out))
+
+
+if __name__ == '__main__':
+    main()
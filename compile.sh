@@ -1,3 +1,3 @@
 #!/bin/sh
 
-gcc -g -O0 main.c
+gcc -g -O0 -pthread main.c
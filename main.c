@@ -2,8 +2,21 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
+#include <stddef.h>
 #include <inttypes.h>
+#include <limits.h>
 #include <assert.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 // Constants returned as part of map mechanisms
 #define MAP_OK           0
@@ -30,6 +43,12 @@
 #define NULLCHECK4(val1, val2, val3, val4) NULLCHECK3(val1, val2, val3); NULLCHECK(val4)
 #define NULLCHECK5(val1, val2, val3, val4, val5) NULLCHECK4(val1, val2, val3, val4); NULLCHECK(val5)
 
+// Non owning, non terminated view of a string
+typedef struct slice_t_ {
+    const char* ptr;
+    size_t len;
+} slice_t;
+
 // Function that does nothing
 void do_nothing(void* _) {
     ;
@@ -58,6 +77,443 @@ const void* shallow_cloner(const void* to_clone) {
     return to_clone;
 }
 
+/*************************************************************************/
+/* Hot path counters. Only compiled in with -DSTATS, otherwise bumping   */
+/* them costs nothing. Shard threads bump them too, hence the atomics.   */
+/* They are dumped by the stats command, along with latency histograms.  */
+/*************************************************************************/
+#ifdef STATS
+typedef struct stats_counters_t_ {
+    uint64_t rel_dropped[2];    // delrel ([0]) and addrel ([1]) involving entities which don't exist
+    uint64_t slab_allocs;       // objects served by the slab allocator
+    uint64_t slab_frees;
+    uint64_t slabs;             // slabs carved, SLAB_BYTES each
+    uint64_t large_allocs;      // objects too big for slabs, served by malloc
+    uint64_t segs_reported;     // report segments output
+    uint64_t segs_rendered;     // report segments rendered (the others come from cache)
+} stats_counters_t;
+
+stats_counters_t stats_counters;
+
+#define STATS_ADD(counter, n) __atomic_fetch_add(&(stats_counters.counter), (n), __ATOMIC_RELAXED)
+#define STATS_GET(counter) __atomic_load_n(&(stats_counters.counter), __ATOMIC_RELAXED)
+#else
+#define STATS_ADD(counter, n)
+#endif
+#define STATS_INC(counter) STATS_ADD(counter, 1)
+
+/*******************************************************************/
+/* Slab allocator. Small structs are carved out of large slabs and */
+/* recycled through free lists, one for each size class. Classes   */
+/* are per thread; an object can be freed by any thread, in which  */
+/* case it simply joins the free list of the freeing thread.       */
+/*******************************************************************/
+#define SLAB_GRANULARITY 8          // size classes are multiples of this
+#define SLAB_MAX_OBJ_SIZE 128       // bigger objects go straight to malloc
+#define SLAB_BYTES (64 * 1024)
+
+typedef struct slab_class_t_ {
+    void* free_list;    // recycled objects, linked through their first word
+    char* bump;         // next never used object in the current slab
+    char* bump_end;
+    void** slabs;       // every slab allocated for this class
+    int slabs_len;
+    int slabs_cap;
+} slab_class_t;
+
+__thread slab_class_t slab_classes[SLAB_MAX_OBJ_SIZE / SLAB_GRANULARITY + 1];
+
+// Slabs of threads which are done allocating, released along with the others
+pthread_mutex_t slab_retired_lock = PTHREAD_MUTEX_INITIALIZER;
+void** slab_retired = NULL;
+int slab_retired_len = 0;
+int slab_retired_cap = 0;
+
+// Size class index serving objects of the given size (objects must fit a free list link)
+int slab_class_of(size_t size) {
+    if (size < sizeof(void*)) size = sizeof(void*);
+    return (int) ((size + SLAB_GRANULARITY - 1) / SLAB_GRANULARITY);
+}
+
+// Allocate object of given size
+void* slab_alloc(size_t size) {
+    if (size > SLAB_MAX_OBJ_SIZE) {
+        STATS_INC(large_allocs);
+        return malloc(size);
+    }
+    STATS_INC(slab_allocs);
+
+    int class_idx = slab_class_of(size);
+    slab_class_t* class = &(slab_classes[class_idx]);
+    size_t obj_size = (size_t) class_idx * SLAB_GRANULARITY;
+
+    // Reuse recycled object if possible
+    if (class->free_list) {
+        void* result = class->free_list;
+        class->free_list = *(void**) result;
+        return result;
+    }
+
+    // Carve a new slab if the current one is exhausted
+    if (class->bump + obj_size > class->bump_end) {
+        if (class->slabs_len == class->slabs_cap) {
+            class->slabs_cap = class->slabs_cap ? class->slabs_cap * 2 : 8;
+            class->slabs = realloc(class->slabs, sizeof(void*) * class->slabs_cap);
+        }
+
+        char* slab = malloc(SLAB_BYTES);
+        if (!slab) {
+            ERROR("Out of memory\n");
+        }
+        STATS_INC(slabs);
+        class->slabs[class->slabs_len++] = slab;
+        class->bump = slab;
+        class->bump_end = slab + SLAB_BYTES;
+    }
+
+    void* result = class->bump;
+    class->bump += obj_size;
+    return result;
+}
+
+// Give back object allocated with slab_alloc. Size must match the one it was allocated with
+void slab_free(void* ptr, size_t size) {
+    if (!ptr)
+        return;
+
+    if (size > SLAB_MAX_OBJ_SIZE) {
+        free(ptr);
+        return;
+    }
+
+    STATS_INC(slab_frees);
+    slab_class_t* class = &(slab_classes[slab_class_of(size)]);
+    *(void**) ptr = class->free_list;
+    class->free_list = ptr;
+}
+
+// Resize object allocated with slab_alloc
+void* slab_realloc(void* ptr, size_t old_size, size_t new_size) {
+    if (ptr && old_size > SLAB_MAX_OBJ_SIZE && new_size > SLAB_MAX_OBJ_SIZE)
+        return realloc(ptr, new_size);
+
+    if (ptr && slab_class_of(old_size) == slab_class_of(new_size))
+        return ptr;
+
+    void* result = slab_alloc(new_size);
+    if (ptr) {
+        memcpy(result, ptr, old_size < new_size ? old_size : new_size);
+        slab_free(ptr, old_size);
+    }
+    return result;
+}
+
+// Hand the slabs of the calling thread over to slab_release_all. Must be called by
+// threads other than the main one before exiting, objects allocated stay valid
+void slab_retire() {
+    pthread_mutex_lock(&slab_retired_lock);
+
+    for (int i = 0; i < (int) (sizeof(slab_classes) / sizeof(slab_classes[0])); i++) {
+        slab_class_t* class = &(slab_classes[i]);
+
+        for (int s = 0; s < class->slabs_len; s++) {
+            if (slab_retired_len == slab_retired_cap) {
+                slab_retired_cap = slab_retired_cap ? slab_retired_cap * 2 : 64;
+                slab_retired = realloc(slab_retired, sizeof(void*) * slab_retired_cap);
+            }
+            slab_retired[slab_retired_len++] = class->slabs[s];
+        }
+        free(class->slabs);
+
+        *class = (slab_class_t) { NULL, NULL, NULL, NULL, 0, 0 };
+    }
+
+    pthread_mutex_unlock(&slab_retired_lock);
+}
+
+// Release every slab at once (those of the calling thread, and the retired ones).
+// Objects still allocated become invalid
+void slab_release_all() {
+    for (int i = 0; i < (int) (sizeof(slab_classes) / sizeof(slab_classes[0])); i++) {
+        slab_class_t* class = &(slab_classes[i]);
+
+        for (int s = 0; s < class->slabs_len; s++)
+            free(class->slabs[s]);
+        free(class->slabs);
+
+        *class = (slab_class_t) { NULL, NULL, NULL, NULL, 0, 0 };
+    }
+
+    pthread_mutex_lock(&slab_retired_lock);
+    for (int s = 0; s < slab_retired_len; s++)
+        free(slab_retired[s]);
+    free(slab_retired);
+    slab_retired = NULL;
+    slab_retired_len = slab_retired_cap = 0;
+    pthread_mutex_unlock(&slab_retired_lock);
+}
+
+/**********************************************************************/
+/* Output buffers. Growable byte buffers with their own (unformatted) */
+/* writers, used to render output without going through stdio.       */
+/**********************************************************************/
+typedef struct outbuf_t_ {
+    char* data;
+    size_t len;
+    size_t cap;
+} outbuf_t;
+
+// Initialize empty buffer
+void outbuf_init(outbuf_t* buf) {
+    buf->data = NULL;
+    buf->len = 0;
+    buf->cap = 0;
+}
+
+// Deallocate buffer storage
+void outbuf_destroy(outbuf_t* buf) {
+    free(buf->data);
+    outbuf_init(buf);
+}
+
+// Make room for extra bytes
+void outbuf_reserve(outbuf_t* buf, size_t extra) {
+    if (buf->len + extra > buf->cap) {
+        size_t new_cap = buf->cap ? buf->cap * 2 : 64;
+        while (new_cap < buf->len + extra) new_cap *= 2;
+
+        buf->data = realloc(buf->data, new_cap);
+        buf->cap = new_cap;
+    }
+}
+
+// Append bytes
+void outbuf_put(outbuf_t* buf, const char* data, size_t len) {
+    outbuf_reserve(buf, len);
+    memcpy(buf->data + buf->len, data, len);
+    buf->len += len;
+}
+
+// Append single character
+void outbuf_putc(outbuf_t* buf, char c) {
+    outbuf_reserve(buf, 1);
+    buf->data[buf->len++] = c;
+}
+
+// Append decimal representation of an integer
+void outbuf_put_int(outbuf_t* buf, int num) {
+    char digits[12]; // enough for any 32 bit int and sign
+    int start = sizeof(digits);
+    unsigned int abs_num = num < 0 ? -(unsigned int) num : (unsigned int) num;
+
+    do {
+        digits[--start] = '0' + abs_num % 10;
+        abs_num /= 10;
+    } while (abs_num);
+
+    if (num < 0) digits[--start] = '-';
+
+    outbuf_put(buf, digits + start, sizeof(digits) - start);
+}
+
+// Write buffer contents to stream with a single call
+void outbuf_write(const outbuf_t* buf, FILE* out_f) {
+    if (buf->len > 0 && fwrite(buf->data, 1, buf->len, out_f) != buf->len) {
+        ERROR("Could not write output\n");
+    }
+}
+
+/*****************************************************************************/
+/* Blocking queue passing work between the stages of the pipeline (see       */
+/* writer_t and pipeline_t). Items are big (chunks of commands or blocks of  */
+/* output), so taking a lock for each one costs next to nothing.             */
+/*****************************************************************************/
+typedef struct pipe_queue_t_ {
+    void** items;       // ring of cap items
+    int cap;
+    int head;
+    int len;
+    int closed;         // 1 once pushing and waiting are over
+    pthread_mutex_t lock;
+    pthread_cond_t changed_cv;
+} pipe_queue_t;
+
+void pipe_queue_init(pipe_queue_t* queue, int cap) {
+    queue->items = malloc(sizeof(void*) * cap);
+    if (!queue->items) ERROR("Out of memory for pipeline\n");
+    queue->cap = cap;
+    queue->head = 0;
+    queue->len = 0;
+    queue->closed = 0;
+    pthread_mutex_init(&(queue->lock), NULL);
+    pthread_cond_init(&(queue->changed_cv), NULL);
+}
+
+void pipe_queue_destroy(pipe_queue_t* queue) {
+    pthread_mutex_destroy(&(queue->lock));
+    pthread_cond_destroy(&(queue->changed_cv));
+    free(queue->items);
+}
+
+// Append item, waiting for room if needed. Returns 0 if the queue was closed
+int pipe_queue_push(pipe_queue_t* queue, void* item) {
+    pthread_mutex_lock(&(queue->lock));
+    while (queue->len == queue->cap && !queue->closed)
+        pthread_cond_wait(&(queue->changed_cv), &(queue->lock));
+
+    int pushed = !queue->closed;
+    if (pushed) {
+        queue->items[(queue->head + queue->len++) % queue->cap] = item;
+        pthread_cond_broadcast(&(queue->changed_cv));
+    }
+    pthread_mutex_unlock(&(queue->lock));
+
+    return pushed;
+}
+
+// Take first item, waiting for it if wait is set. NULL if there's none (left)
+void* pipe_queue_pop(pipe_queue_t* queue, int wait) {
+    pthread_mutex_lock(&(queue->lock));
+    while (wait && queue->len == 0 && !queue->closed)
+        pthread_cond_wait(&(queue->changed_cv), &(queue->lock));
+
+    void* item = NULL;
+    if (queue->len > 0) {
+        item = queue->items[queue->head];
+        queue->head = (queue->head + 1) % queue->cap;
+        queue->len--;
+        pthread_cond_broadcast(&(queue->changed_cv));
+    }
+    pthread_mutex_unlock(&(queue->lock));
+
+    return item;
+}
+
+// Stop accepting items, items still in the queue can be popped
+void pipe_queue_close(pipe_queue_t* queue) {
+    pthread_mutex_lock(&(queue->lock));
+    queue->closed = 1;
+    pthread_cond_broadcast(&(queue->changed_cv));
+    pthread_mutex_unlock(&(queue->lock));
+}
+
+/****************************************************************************/
+/* Output writer. When pipelined, output is gathered in blocks which a      */
+/* writer thread writes to the output stream, so that the thread applying   */
+/* commands never waits on a slow stream (unless every block is in flight). */
+/****************************************************************************/
+#define WRITER_BLOCK_BYTES (1 << 16)    // output gathered before handing a block over
+#define WRITER_BLOCKS 8                 // blocks in flight, bounding buffered output
+
+typedef struct writer_t_ {
+    FILE* out_f;
+    outbuf_t* pending;      // block being filled
+    outbuf_t* blocks[WRITER_BLOCKS];
+    pipe_queue_t full;      // blocks waiting to be written
+    pipe_queue_t empty;     // blocks written, to be filled again
+    pthread_t owner;        // thread filling pending blocks
+    pthread_t thread;
+} writer_t;
+
+// Writer of the running program, NULL unless pipelined
+writer_t* writer = NULL;
+
+void* writer_run(void* writer_v) {
+    writer_t* writer = (writer_t*) writer_v;
+
+    for (outbuf_t* block; (block = pipe_queue_pop(&(writer->full), 1));) {
+        outbuf_write(block, writer->out_f);
+        block->len = 0;
+        pipe_queue_push(&(writer->empty), block);
+    }
+
+    return NULL;
+}
+
+writer_t* writer_new(FILE* out_f) {
+    writer_t* result = malloc(sizeof(writer_t));
+    if (!result) ERROR("Out of memory for writer\n");
+
+    result->out_f = out_f;
+    result->owner = pthread_self();
+    pipe_queue_init(&(result->full), WRITER_BLOCKS);
+    pipe_queue_init(&(result->empty), WRITER_BLOCKS);
+    for (int i = 0; i < WRITER_BLOCKS; i++) {
+        result->blocks[i] = malloc(sizeof(outbuf_t));
+        if (!result->blocks[i]) ERROR("Out of memory for writer\n");
+        outbuf_init(result->blocks[i]);
+        outbuf_reserve(result->blocks[i], WRITER_BLOCK_BYTES);
+        pipe_queue_push(&(result->empty), result->blocks[i]);
+    }
+    result->pending = pipe_queue_pop(&(result->empty), 1);
+
+    if (pthread_create(&(result->thread), NULL, &writer_run, result) != 0)
+        ERROR("Could not start writer thread\n");
+
+    return result;
+}
+
+// Hand pending output over to the writer thread
+void writer_flush(writer_t* writer) {
+    if (writer->pending->len == 0) {
+        return;
+    }
+
+    pipe_queue_push(&(writer->full), writer->pending);
+    writer->pending = pipe_queue_pop(&(writer->empty), 1);
+}
+
+// Wait until every output is written, so that the stream can be written directly
+void writer_drain(writer_t* writer) {
+    writer_flush(writer);
+
+    outbuf_t* written[WRITER_BLOCKS];
+    for (int i = 0; i < WRITER_BLOCKS - 1; i++)
+        written[i] = pipe_queue_pop(&(writer->empty), 1);
+    for (int i = 0; i < WRITER_BLOCKS - 1; i++)
+        pipe_queue_push(&(writer->empty), written[i]);
+}
+
+// Write buffer contents to stream, through the writer if there is one
+void output_write(const outbuf_t* buf, FILE* out_f) {
+    if (!writer) {
+        outbuf_write(buf, out_f);
+        return;
+    }
+
+    outbuf_put(writer->pending, buf->data, buf->len);
+    if (writer->pending->len >= WRITER_BLOCK_BYTES) {
+        writer_flush(writer);
+    }
+}
+
+// Write every pending output, then stop writer thread and deallocate writer
+void writer_free(writer_t* writer) {
+    if (!writer) {
+        return;
+    }
+
+    writer_flush(writer);
+    pipe_queue_close(&(writer->full));
+    pthread_join(writer->thread, NULL);
+
+    for (int i = 0; i < WRITER_BLOCKS; i++) {
+        outbuf_destroy(writer->blocks[i]);
+        free(writer->blocks[i]);
+    }
+    pipe_queue_destroy(&(writer->full));
+    pipe_queue_destroy(&(writer->empty));
+    free(writer);
+}
+
+// Write what's left when exiting on an error, as stdio does with its buffers
+void writer_exit() {
+    if (writer && pthread_equal(pthread_self(), writer->owner)) {
+        writer_free(writer);
+        writer = NULL;
+    }
+}
+
 /************************************************************************************/
 /* Generic map datastructure. Implemented using a BST. Also used to represent sets. */
 /************************************************************************************/
@@ -71,11 +527,6 @@ int intcmp(const void* lhs, const void* rhs) {
     return (intptr_t) lhs - (intptr_t) rhs;
 }
 
-// Custom duplication handling function that singals the failed instertion
-int signal_insertion_fail(const void* key, void* old_ele, void* new_ele) {
-    return MAP_OPERATION_FAILED;
-}
-
 // Custom duplication handling function that throws an error
 // (needed for when duplicates should not be encountered)
 int disallow_duplicates(const void* key, void* old_ele, void* new_ele) {
@@ -121,6 +572,8 @@ typedef struct _map_node_t {
     struct _map_node_t* parent;
     struct _map_node_t* left;
     struct _map_node_t* right;
+    int height; // AVL height of the subtree rooted in this node (leaves have height 1)
+    int size;   // nodes in the subtree rooted in this node
 } map_node_t;
 
 // Set type
@@ -136,10 +589,12 @@ typedef struct _map_t {
 
 // Create a new node with no children
 map_node_t* map_node_new(const char* key, void* data, map_node_t* parent, key_cloner_fun_t clone_key) {
-    map_node_t* result = malloc(sizeof(map_node_t));
+    map_node_t* result = slab_alloc(sizeof(map_node_t));
     result->parent = parent;
     result->left = NULL;
     result->right = NULL;
+    result->height = 1;
+    result->size = 1;
     result->key = clone_key(key);
     result->data = data;
     return result;
@@ -154,7 +609,7 @@ int node_is_leaf(const map_node_t* node) {
 map_t* map_empty( compfun_t comp, key_cloner_fun_t clone_key,
         handle_dup_fun_t handle_dup, free_key_fun_t free_key,
         free_element_fun_t free_element) {
-    map_t* result = malloc(sizeof(map_t));
+    map_t* result = slab_alloc(sizeof(map_t));
 
     result->root = NULL;
     result->len = 0;
@@ -167,6 +622,56 @@ map_t* map_empty( compfun_t comp, key_cloner_fun_t clone_key,
     return result;
 }
 
+/*********************************************************************/
+/* Map iteration. Walks use parent links, so they need no recursion  */
+/* and no stack. Nodes are relinked (never swapped) on removal, so   */
+/* the current node of an iterator can be removed without issues.    */
+/*********************************************************************/
+// In order traversal helpers
+map_node_t* node_leftmost(map_node_t* root) {
+    if (root) while (root->left) root = root->left;
+    return root;
+}
+map_node_t* node_next(map_node_t* node) {
+    if (node->right)
+        return node_leftmost(node->right);
+
+    while (node->parent && node->parent->right == node)
+        node = node->parent;
+
+    return node->parent;
+}
+
+// In order map iterator. Usage:
+//  for (map_iter_t it = map_iter(map); map_iter_next(&it);) { ... it.cur ... }
+typedef struct map_iter_t_ {
+    map_node_t* cur;  // current node, NULL before the first call to map_iter_next
+    map_node_t* next; // fetched in advance so that cur can be removed
+} map_iter_t;
+
+// Get iterator positioned before the first element of the map
+map_iter_t map_iter(const map_t* map) {
+    map_iter_t result = { NULL, node_leftmost(map->root) };
+    return result;
+}
+
+// Advance iterator, returns 0 once past the last element
+int map_iter_next(map_iter_t* iter) {
+    iter->cur = iter->next;
+    if (iter->cur)
+        iter->next = node_next(iter->cur);
+    return iter->cur != NULL;
+}
+
+// Remove current element of the iterator from map (the iterator stays valid)
+void map_remove_node(map_t* map, map_node_t* to_remove);
+void map_iter_remove(map_t* map, map_iter_t* iter) {
+    NULLCHECK(iter->cur);
+
+    map_remove_node(map, iter->cur);
+    iter->cur = NULL;
+}
+
 // Various ways of freeing memory allocated by given map
 void node_free(map_node_t*, free_key_fun_t, free_element_fun_t);
 int map_free(map_t* map) {
@@ -174,7 +679,7 @@ int map_free(map_t* map) {
         return MAP_ERR_NULL_MAP;
 
     node_free(map->root, map->free_key, map->free_element); map->root = NULL;
-    free(map);
+    slab_free(map, sizeof(map_t));
 
     return MAP_OK;
 }
@@ -184,18 +689,36 @@ void map_vfree(void* map) {
         ERROR("Encountered error in freeing map!");
     }
 }
-void node_free(map_node_t* node, free_key_fun_t free_key, free_element_fun_t free_ele) {
-    if (node) {
+// Free a whole subtree in post order, climbing back through parent links
+void node_free(map_node_t* root, free_key_fun_t free_key, free_element_fun_t free_ele) {
+    map_node_t* node = root;
+
+    while (node) {
+        // Descend until a leaf is found
+        if (node->left) {
+            node = node->left;
+            continue;
+        }
+        if (node->right) {
+            node = node->right;
+            continue;
+        }
+
+        // Detach leaf from its parent, so that the parent becomes a leaf in turn
+        map_node_t* parent = node == root ? NULL : node->parent;
+        if (parent) {
+            if (parent->left == node) parent->left = NULL;
+            else                      parent->right = NULL;
+        }
+
         // Free data the node contains.
         free_key((void*) node->key);
         free_ele(node->data);
 
-        // Recursively free left and right nodes
-        node_free(node->left, free_key, free_ele);
-        node_free(node->right, free_key, free_ele);
+        // Give memory occupied by node structure itself back to its slab
+        slab_free(node, sizeof(map_node_t));
 
-        // Free memory occupied by node structure itself
-        free(node);
+        node = parent;
     }
 }
 
@@ -203,7 +726,6 @@ void node_free(map_node_t* node, free_key_fun_t free_key, free_element_fun_t fre
 #define PRINT_MODE_CUSTOM 0
 #define PRINT_MODE_DB 1
 #define PRINT_MODE_SET 2
-void node_print(FILE*, map_node_t*, printer_fun_t, printer_fun_t, int);
 int map_print_with(FILE* out_f, const map_t* map,
         printer_fun_t print_key,
         printer_fun_t print_ele,
@@ -214,7 +736,14 @@ int map_print_with(FILE* out_f, const map_t* map,
     if (print_mode == PRINT_MODE_DB || print_mode == PRINT_MODE_SET)
         fputs("{ ", out_f);
 
-    node_print(out_f, map->root, print_key, print_ele, print_mode);
+    for (map_iter_t it = map_iter(map); map_iter_next(&it);) {
+        if (print_mode == PRINT_MODE_DB) fputs("(", out_f);
+        print_key(out_f, it.cur->key);
+        if (print_mode == PRINT_MODE_DB) fputs(": ", out_f);
+        print_ele(out_f, it.cur->data);
+        if (print_mode == PRINT_MODE_DB) fputs(") ", out_f);
+        else if (print_mode == PRINT_MODE_SET) fputs(", ", out_f);
+    }
 
     if (print_mode == PRINT_MODE_DB || print_mode == PRINT_MODE_SET)
         fputs("}", out_f);
@@ -232,117 +761,150 @@ int map_print(FILE* out_f, map_t* map, int print_mode) {
 int map_db_print(FILE* out_f, map_t* map) {
     return map_print(out_f, map, PRINT_MODE_DB);
 }
-// Helper function to aid recursion in map printing 
-void node_print(FILE* out_f, map_node_t* node,
-        printer_fun_t print_key,
-        printer_fun_t print_ele,
-        int print_mode) {
-    if (node) {
-        node_print(out_f, node->left, print_key, print_ele, print_mode);
 
-        if (print_mode == PRINT_MODE_DB) fputs("(", out_f);
-        print_key(out_f, node->key);
-        if (print_mode == PRINT_MODE_DB) fputs(": ", out_f);
-        print_ele(out_f, node->data);
-        if (print_mode == PRINT_MODE_DB) fputs(") ", out_f);
-        else if (print_mode == PRINT_MODE_SET) fputs(", ", out_f);
+/*****************************************************/
+/* AVL balancing. Keeps every map at O(log n) height */
+/* regardless of the order in which keys are added.  */
+/*****************************************************/
+// Height of a (possibly empty) subtree
+int node_height(const map_node_t* node) {
+    return node ? node->height : 0;
+}
 
-        node_print(out_f, node->right, print_key, print_ele, print_mode);
-    }
+// Size of a (possibly empty) subtree
+int node_size(const map_node_t* node) {
+    return node ? node->size : 0;
 }
 
-// Insert element at rightmost node 
-int node_add(map_node_t**, map_node_t*, compfun_t comp, handle_dup_fun_t, map_node_t*);
-void node_insert_at_rightmost(map_node_t** root, map_node_t* to_insert) {
-    if (root == NULL) {
-        ERROR("Null pointer ref");
-    }
+// Recompute height and size of node from the ones of its children
+void node_update_height(map_node_t* node) {
+    int left_h = node_height(node->left);
+    int right_h = node_height(node->right);
+    node->height = 1 + (left_h > right_h ? left_h : right_h);
+    node->size = 1 + node_size(node->left) + node_size(node->right);
+}
 
-    if (*root == NULL) {
-        *root = to_insert;
-        return;
-    }
+// Positive if left-heavy, negative if right-heavy
+int node_balance(const map_node_t* node) {
+    return node_height(node->left) - node_height(node->right);
+}
+
+// Returns the reference (either the map root or a child field of the parent)
+// that points to the given node
+map_node_t** node_parent_slot(map_t* map, map_node_t* node) {
+    map_node_t* parent = node->parent;
 
-    node_insert_at_rightmost(&((*root)->right), to_insert);
+    if (!parent)
+        return &(map->root);
+
+    return parent->left == node ? &(parent->left) : &(parent->right);
 }
 
-// Insert element at leftmost node
-void node_insert_at_leftmost(map_node_t** root, map_node_t* to_insert) {
-    if (root == NULL) {
-        ERROR("Null pointer ref");
-    }
+// Rotations; both return the new root of the rotated subtree
+map_node_t* node_rotate_left(map_t* map, map_node_t* node) {
+    map_node_t* pivot = NOTNULL(node->right);
+    map_node_t** slot = node_parent_slot(map, node);
 
-    if (*root == NULL) {
-        *root = to_insert;
-        return;
-    }
+    node->right = pivot->left;
+    if (pivot->left) pivot->left->parent = node;
+
+    pivot->left = node;
+    pivot->parent = node->parent;
+    node->parent = pivot;
+    *slot = pivot;
+
+    node_update_height(node);
+    node_update_height(pivot);
+
+    return pivot;
+}
+map_node_t* node_rotate_right(map_t* map, map_node_t* node) {
+    map_node_t* pivot = NOTNULL(node->left);
+    map_node_t** slot = node_parent_slot(map, node);
+
+    node->left = pivot->right;
+    if (pivot->right) pivot->right->parent = node;
+
+    pivot->right = node;
+    pivot->parent = node->parent;
+    node->parent = pivot;
+    *slot = pivot;
 
-    node_insert_at_leftmost(&((*root)->left), to_insert);
+    node_update_height(node);
+    node_update_height(pivot);
+
+    return pivot;
+}
+
+// Restore the AVL invariant on the path going from node up to the root
+void map_rebalance_from(map_t* map, map_node_t* node) {
+    while (node) {
+        node_update_height(node);
+
+        int balance = node_balance(node);
+        if (balance > 1) {
+            if (node_balance(node->left) < 0)
+                node_rotate_left(map, node->left);
+            node = node_rotate_right(map, node);
+        } else if (balance < -1) {
+            if (node_balance(node->right) > 0)
+                node_rotate_right(map, node->right);
+            node = node_rotate_left(map, node);
+        }
+
+        node = node->parent;
+    }
 }
 
+// Hook a freshly allocated node into an empty slot found by a previous descent
+void map_attach_node(map_t* map, map_node_t** slot, map_node_t* parent, map_node_t* to_attach) {
+    NULLCHECK2(slot, to_attach);
+    assert(*slot == NULL);
+
+    to_attach->parent = parent;
+    *slot = to_attach;
+    map->len++;
+
+    map_rebalance_from(map, parent);
+}
 
 // Add an element to the map
+map_node_t** node_get_ref_and_parent(map_node_t**, const void*, compfun_t, map_node_t**);
 int map_add(map_t* map, const void* key, void* element) {
     if (element == NULL)                            
         return MAP_ERR_NULL_ELE;                    
     if (map == NULL)
         return MAP_ERR_NULL_MAP;
 
-    // TODO: OPT: make node_inplace_add
-    map_node_t* node_to_add = map_node_new(key, element, NULL, map->clone_key);
-    int result = node_add(&(map->root), node_to_add, map->comp, map->handle_dup, NULL);
+    map_node_t* parent = NULL;
+    map_node_t** target_node_ref = node_get_ref_and_parent(&(map->root), key, map->comp, &parent);
 
-    if (result == MAP_OPERATION_FAILED) {
-        // TODO: OPT: Optimization opportunity: do not do this free
-        node_free(node_to_add, map->free_key, map->free_element);
-        return MAP_OPERATION_FAILED;
+    if (*target_node_ref) {
+        return map->handle_dup(key, (*target_node_ref)->data, element);
     }
 
-    map->len++;
+    map_attach_node(map, target_node_ref, parent,
+            map_node_new(key, element, parent, map->clone_key));
+
     return MAP_OK;
 }                                                   
 // Variant for sets
-map_node_t** node_get_ref(map_node_t**, const void*, compfun_t); // forward dec.
 int set_add(map_t* set, const void* element) {
-    map_node_t** target_node_ref = NOTNULL(node_get_ref(&(set->root), element, set->comp));
+    map_node_t* parent = NULL;
+    map_node_t** target_node_ref = node_get_ref_and_parent(&(set->root), element, set->comp, &parent);
+    NULLCHECK(target_node_ref);
 
     if (*target_node_ref == NULL)  {
-        *target_node_ref = map_node_new(element, (void*) element, NULL, set->clone_key);
-        (*target_node_ref)->data = (void*) (*target_node_ref)->key;
+        map_node_t* new_node = map_node_new(element, (void*) element, parent, set->clone_key);
+        new_node->data = (void*) new_node->key;
 
-        set->len++;
+        map_attach_node(set, target_node_ref, parent, new_node);
 
         return MAP_OK;
     } else  {
         return set->handle_dup(element, (*target_node_ref)->data, (void*) element);
     }
 }
-// Helper function to aid recursion
-//  NB. cur_parent is meant to be NULL at first call
-int node_add(map_node_t** root_ref, map_node_t* to_add,
-        compfun_t comp, handle_dup_fun_t handle_dup,
-        map_node_t* cur_parent) {
-    if (root_ref == NULL) {
-        ERROR("Null pointer ref");
-    }
-
-    map_node_t* root = *root_ref;
-
-    if (root == NULL) {
-        to_add->parent = cur_parent;
-        *root_ref = to_add;
-        return MAP_OK;
-    } else {
-        int comp_res = comp(to_add->key, root->data);
-        if (comp_res == 0) {
-            return handle_dup(to_add->key, root->data, to_add->data);
-        } else if (comp_res < 0) {
-            return node_add(&(root->left), to_add, comp, handle_dup, root);
-        } else {
-            return node_add(&(root->right), to_add, comp, handle_dup, root);
-        }
-    }
-}
 
 // Retrieves the specified element from a map. Returns NULL if there is no
 // such element inside the map.
@@ -360,580 +922,4430 @@ void* map_get(map_t* map, const void* element) {
     return wanted_node->data;
 }
 // Helpers for node_get function.
+//  NB. *parent_ret is only written when descending, so it's meant to be NULL at first call
 map_node_t** node_get_ref_and_parent(map_node_t** root_ref, const void* key, compfun_t comp,
                                      map_node_t** parent_ret) {
     NULLCHECK2(root_ref, parent_ret);
 
-    map_node_t* root = *root_ref;
-
-    if (!root) {
-        return root_ref;
-    }
-    
     // Navigate tree
-    int comp_result = comp(key, root->key);
-    if (comp_result == 0) {
-        return root_ref;
-    } else if (comp_result < 0) {
-        *parent_ret = root;
-        return node_get_ref(&(root->left), key, comp);
-    } else {
+    while (*root_ref) {
+        map_node_t* root = *root_ref;
+
+        int comp_result = comp(key, root->key);
+        if (comp_result == 0) {
+            break;
+        }
+
         *parent_ret = root;
-        return node_get_ref(&(root->right), key, comp);
+        root_ref = comp_result < 0 ? &(root->left) : &(root->right);
     }
+
+    return root_ref;
 }
 map_node_t** node_get_ref(map_node_t** root_ref, const void* element, compfun_t comp) {  
-    map_node_t* _;
+    map_node_t* _ = NULL;
     return node_get_ref_and_parent(root_ref, element, comp, &_);
 }
 map_node_t* node_get(map_node_t* root, const void* element, compfun_t comp) {
-    // TODO: Optimization chance: unnecessary ref/deref could be removed by allowing some code duplication.
-    return *(node_get_ref(&root, element, comp));
-}
-
-// Attempts to retrieve a specified element, replacing it with a value produced from a
-// given funptr if it [the element to retrieve] is not present
-void* map_get_or(map_t* map, const void* key, map_ele_maker_fun_t make_ele) {
-    map_node_t* parent;
-    map_node_t** found_node_ref = NOTNULL(node_get_ref_and_parent(&(map->root), key, map->comp, &parent));
+    while (root) {
+        int comp_result = comp(element, root->key);
+        if (comp_result == 0) {
+            break;
+        }
 
-    if (!(*found_node_ref)) {
-        *found_node_ref = map_node_new(key, make_ele(), parent, map->clone_key);
-        map->len++;
+        root = comp_result < 0 ? root->left : root->right;
     }
 
-    return (*found_node_ref)->data;
-}
-
-// Gets the map entry corresponding to the key with the greatest value in the map
-map_node_t* node_get_rightmost(map_node_t* root, compfun_t comp) {
-    if (!root || !(root->right)) return root;
-
-    return node_get_rightmost(root->right, comp);
-}
-map_node_t* map_get_max_node(const map_t* map) {
-    return node_get_rightmost(map->root, map->comp);
+    return root;
 }
 
-// Remove an element from a given map and return it
-map_node_t* node_remove(map_node_t**, compfun_t comp);
-int map_remove(map_t* map, const void* ele_to_remove) {
-    NULLCHECK2(map, ele_to_remove);
-
-    map_node_t** node_to_remove = node_get_ref(&(map->root), ele_to_remove, map->comp);
-
-    if (*node_to_remove) {
-        map->len--;
+// Attempts to retrieve the node of a specified element, adding it with a value produced
+// from a given funptr if it [the element to retrieve] is not present
+map_node_t* map_get_node_or(map_t* map, const void* key, map_ele_maker_fun_t make_ele) {
+    map_node_t* parent = NULL;
+    map_node_t** found_node_ref = node_get_ref_and_parent(&(map->root), key, map->comp, &parent);
+    NULLCHECK(found_node_ref);
 
-        node_free(
-            node_remove(node_to_remove, map->comp),
-            map->free_key,
-            map->free_element
-        );
+    if (!(*found_node_ref)) {
+        map_node_t* new_node = map_node_new(key, make_ele(), parent, map->clone_key);
 
-        return MAP_OK;
-    } else {
-        return MAP_OPERATION_FAILED;
-    }
-}
-// Helper function to remove element from map node
-map_node_t* node_remove(map_node_t** to_remove_ref, compfun_t comp) {
-    if (!to_remove_ref) {
-        return NULL;
-    }
+        // Rebalancing may move things around, but the node itself stays put
+        map_attach_node(map, found_node_ref, parent, new_node);
 
-    map_node_t* to_remove = *to_remove_ref;                           
-
-    // Get correct information                                        
-    // TODO: optimization opportunity: do not choose tree albitrarily 
-    map_node_t* substitute = NULL;                                    
-    map_node_t** overlapping_top = NULL;                              
-    map_node_t** overlapping_bottom = NULL;                           
-    map_node_t** to_shift = NULL;                                     
-    void (*overlap_insert)(map_node_t**, map_node_t*) = NULL;         
-    if (to_remove->right) {                                           
-        substitute = to_remove->right;                                
-        overlapping_top = &(to_remove->left);                         
-        if (substitute) {                                             
-            to_shift = &(substitute->right);                          
-            overlapping_bottom = &(substitute->left);                 
-        }                                                             
-        overlap_insert = &node_insert_at_leftmost;                    
-    } else {                                                          
-        substitute = to_remove->left;                                 
-        overlapping_top = &(to_remove->right);                        
-        if (substitute) {                                             
-            overlapping_bottom = &(substitute->right);                
-            to_shift = &(substitute->left);                           
-        }                                                             
-        overlap_insert = &node_insert_at_rightmost;                   
-    }                                                                 
-
-    if (substitute) {
-        // Handle overlap
-        overlap_insert(overlapping_bottom, *overlapping_top);
-        *overlapping_top = NULL;
-
-        // Set substition fields
-        substitute->parent = to_remove->parent;
+        return new_node;
     }
 
-    // Do substitution
-    *to_remove_ref = substitute;
-
-    // Isolate removed node and return it
-    to_remove->parent = NULL;
-    to_remove->left = NULL;
-    to_remove->right = NULL;
-    return to_remove;
+    return *found_node_ref;
 }
 
-// Variant for map_inner_remove also collecting length for optimization purpuses
-int map_inner_remove_get_len(map_t* outer_map, const void* outer_key, const void* inner_key,
-                             int* len_ret) {
-    NULLCHECK(len_ret);
-
-    map_node_t** inner_map_node_ref = node_get_ref(&(outer_map->root), outer_key, outer_map->comp);
-    if (*inner_map_node_ref) {
-        map_t* inner_map = (map_t*) (*inner_map_node_ref)->data;
-        int res = map_remove(inner_map, inner_key);
+// Same as map_get_node_or, but retrieving the element itself
+void* map_get_or(map_t* map, const void* key, map_ele_maker_fun_t make_ele) {
+    return map_get_node_or(map, key, make_ele)->data;
+}
 
-        *len_ret = inner_map->len;
+// Order statistics, both O(log n) thanks to subtree sizes. The amount of keys in a
+// range is the difference between the ranks of its ends.
+// Amount of keys in the map which are smaller than the given one
+int map_rank(const map_t* map, const void* key) {
+    int result = 0;
 
-        if (res == MAP_OK) {
-            // Completely remove outer entry from map if inner map is emptied
-            if (inner_map->len == 0) {
-                map_node_t* removed = node_remove(inner_map_node_ref, outer_map->comp);
-                node_free(removed, outer_map->free_key, outer_map->free_element);
+    for (map_node_t* node = map->root; node;) {
+        int comp_result = map->comp(key, node->key);
 
-                outer_map->len--;
-            }
-            return MAP_OK;
+        if (comp_result <= 0) {
+            node = node->left;
         } else {
-            return res;
+            result += node_size(node->left) + 1;
+            node = node->right;
         }
     }
-    return MAP_OPERATION_FAILED;
-}
 
-// Remove an element from a map of maps, also removing outer map element if the inner
-// map is left empty
-int map_inner_remove(map_t* outer_map, const void* outer_key, const void* inner_key) {
-    int _;
-    return map_inner_remove_get_len(outer_map, outer_key, inner_key, &_);
+    return result;
 }
+// Node holding the idx-th smallest key (counting from 0), NULL if out of range
+map_node_t* map_select(const map_t* map, int idx) {
+    map_node_t* node = map->root;
 
+    while (node) {
+        int left_size = node_size(node->left);
 
+        if (idx == left_size)
+            break;
 
-/***************************************************************/
-/* String set interface built on top of BST map implementation */
-/***************************************************************/
-// Allocate empty string set (variation of map)
-map_t* strset_empty() {
-    map_t* result = malloc(sizeof(map_t));
-
-    result->root = NULL;
-    result->len = 0;
-    result->comp = &strcomp;
-    result->clone_key = &str_cloner;
-    result->handle_dup = &signal_insertion_fail;
-    // Sets have identical keys and elements, so they need to be freed only once
-    result->free_key = &free;
-    result->free_element = &do_nothing;
+        if (idx < left_size) {
+            node = node->left;
+        } else {
+            idx -= left_size + 1;
+            node = node->right;
+        }
+    }
 
-    return result;
+    return node;
 }
 
-// Allocate string set (variation of map) with a single element inside it
-map_t* strset_single(const char* element) {
-    map_t* result = malloc(sizeof(map_t));
+// Build a perfectly balanced tree out of sorted elements (recursion depth is logarithmic)
+map_node_t* node_build_sorted(const map_t* map, const void** keys, void** data, int len,
+                              map_node_t* parent) {
+    if (len == 0) return NULL;
 
-    result->root = map_node_new((const void*) element, (void*) element, NULL, &str_cloner);
-    result->len = 1;
-    result->comp = &strcomp;
-    result->handle_dup = &disallow_duplicates;
-    // Sets have identical keys and elements, so they need to be freed only once
-    result->free_key = &free;
-    result->free_element = &do_nothing;
+    int mid = len / 2;
+    map_node_t* node = map_node_new(keys[mid], data[mid], parent, map->clone_key);
+    node->left = node_build_sorted(map, keys, data, mid, node);
+    node->right = node_build_sorted(map, keys + mid + 1, data + mid + 1, len - mid - 1, node);
+    node_update_height(node);
 
-    return result;
-}
-// Used to allocate for compatibility with map_t interface
-void* v_strset_empty() {
-    return (void*) strset_empty();
+    return node;
 }
 
-// Used to print strsets in maps
-void strset_printer(FILE* out_f, const void* to_print) {
-    map_print_with(out_f, (const map_t*) to_print, &str_printer, &noop_printer, PRINT_MODE_SET);
+// Fill empty map with elements whose keys are distinct and sorted according to the map,
+// without comparing nor rebalancing anything
+void map_fill_sorted(map_t* map, const void** keys, void** data, int len) {
+    assert(map->len == 0);
+
+    map->root = node_build_sorted(map, keys, data, len, NULL);
+    map->len = len;
 }
 
-/**********************************************/
-/* Data types used to construct relations map */
-/**********************************************/
-typedef struct relinfo_t_ {
-    map_t* rxing_ents_map;    // map of (str: set(str))
-    map_t* rxing_amounts_map; // map of (int: set(str))
-} relinfo_t;
-// Custom free function
-void relinfo_free(void* to_free_v) {
-    relinfo_t* to_free = (relinfo_t*) to_free_v;
+// Unlink a node from the map, rebalance it and return the isolated node.
+//  NB. map length is left untouched
+map_node_t* node_remove(map_t* map, map_node_t* to_remove) {
+    NULLCHECK2(map, to_remove);
 
-    map_free(to_free->rxing_ents_map);
-    map_free(to_free->rxing_amounts_map);
+    map_node_t** to_remove_ref = node_parent_slot(map, to_remove);
+    map_node_t* rebalance_start;
 
-    free(to_free);
-}
+    if (to_remove->left && to_remove->right) {
+        // Substitute removed node with its in order successor
+        map_node_t* substitute = node_leftmost(to_remove->right);
 
-// Allocate new empty relinfo
-relinfo_t* relinfo_empty() {
-    relinfo_t* result = malloc(sizeof(relinfo_t));
+        if (substitute->parent == to_remove) {
+            rebalance_start = substitute;
+        } else {
+            rebalance_start = substitute->parent;
 
-    result->rxing_ents_map = map_empty(&strcomp, &str_cloner, &disallow_duplicates, &free, &map_vfree);
-    result->rxing_amounts_map = map_empty(&intcmp, &shallow_cloner, &disallow_duplicates, &do_nothing, &map_vfree);
+            // Successor has no left child: hoist its right subtree in its place
+            substitute->parent->left = substitute->right;
+            if (substitute->right) substitute->right->parent = substitute->parent;
+
+            substitute->right = to_remove->right;
+            to_remove->right->parent = substitute;
+        }
+
+        substitute->left = to_remove->left;
+        to_remove->left->parent = substitute;
+
+        substitute->parent = to_remove->parent;
+        substitute->height = to_remove->height;
+        *to_remove_ref = substitute;
+    } else {
+        map_node_t* child = to_remove->left ? to_remove->left : to_remove->right;
+
+        if (child) child->parent = to_remove->parent;
+        *to_remove_ref = child;
+
+        rebalance_start = to_remove->parent;
+    }
+
+    map_rebalance_from(map, rebalance_start);
+
+    // Isolate removed node and return it
+    to_remove->parent = NULL;
+    to_remove->left = NULL;
+    to_remove->right = NULL;
+    return to_remove;
+}
+
+// Remove a given node from the map and deallocate it
+void map_remove_node(map_t* map, map_node_t* to_remove) {
+    node_free(node_remove(map, to_remove), map->free_key, map->free_element);
+    map->len--;
+}
+
+// Remove an element from a given map
+int map_remove(map_t* map, const void* ele_to_remove) {
+    NULLCHECK2(map, ele_to_remove);
+
+    map_node_t* node_to_remove = node_get(map->root, ele_to_remove, map->comp);
+
+    if (node_to_remove) {
+        map_remove_node(map, node_to_remove);
+        return MAP_OK;
+    } else {
+        return MAP_OPERATION_FAILED;
+    }
+}
+
+/****************************************************************************/
+/* B-tree map. Entries are packed in arrays filling a few cache lines, so a */
+/* lookup touches a node per level with a fraction of the levels of a       */
+/* binary tree. Entries only live in the leaves, which are linked in key    */
+/* order for iteration. Inner nodes hold the smallest key below each child  */
+/* (never owning it, and never comparing against the first one). Used for   */
+/* the maps that grow large, the rest are AVL trees (see map_t).            */
+/* String keys are stored along with their first 24 bytes, so comparisons  */
+/* during a descent stay within the node unless two keys share them.        */
+/****************************************************************************/
+#define BMAP_FANOUT 16                  // entries (or children) per node
+#define BMAP_MIN_LEN (BMAP_FANOUT / 2)  // fill of every node but the root
+#define BMAP_MAX_DEPTH 16               // enough for far more than 2^32 entries
+#define BMAP_PREFIX_WORDS 3             // words of string keys stored inline
+
+// Key along with its inline prefix. The prefix holds the first bytes of string keys
+// (zero padded, big endian words) so that comparing prefixes a word at a time orders
+// them as strcmp would. It's all zeros for other keys
+typedef struct bmap_key_t_ {
+    uint64_t prefix[BMAP_PREFIX_WORDS];
+    const void* key;
+} bmap_key_t;
+
+// Node parts are kept in separate arrays, so a search mostly reads the first prefix
+// words alone
+typedef struct bmap_node_t_ {
+    int len;
+    int is_leaf;
+    struct bmap_node_t_* next;  // next leaf in key order
+    uint64_t prefixes[BMAP_PREFIX_WORDS][BMAP_FANOUT];
+    const void* keys[BMAP_FANOUT];
+    void* slots[BMAP_FANOUT];   // data in leaves, children in inner nodes
+} bmap_node_t;
+
+typedef struct bmap_t_ {
+    bmap_node_t* root;          // NULL while empty
+    int len;
+    int height;                 // levels of nodes (all leaves are at the same depth)
+    int str_keys;               // 1 if keys are strings, whose prefix is stored inline
+    compfun_t comp;
+    key_cloner_fun_t clone_key;
+    free_key_fun_t free_key;
+    free_element_fun_t free_element;
+} bmap_t;
+
+// Nodes from the root to a leaf, along with the position taken in each one
+typedef struct bmap_path_t_ {
+    bmap_node_t* nodes[BMAP_MAX_DEPTH];
+    int idxs[BMAP_MAX_DEPTH];
+    int depth;
+} bmap_path_t;
+
+// Create a new empty map. If keys are strings (str_keys = 1), comp must order them
+// as strcmp does
+bmap_t* bmap_empty(int str_keys, compfun_t comp, key_cloner_fun_t clone_key,
+                   free_key_fun_t free_key, free_element_fun_t free_element) {
+    bmap_t* result = slab_alloc(sizeof(bmap_t));
+
+    result->root = NULL;
+    result->len = 0;
+    result->height = 0;
+    result->str_keys = str_keys;
+    result->comp = comp;
+    result->clone_key = clone_key;
+    result->free_key = free_key;
+    result->free_element = free_element;
+
+    return result;
+}
+
+bmap_node_t* bmap_node_new(int is_leaf) {
+    bmap_node_t* result = slab_alloc(sizeof(bmap_node_t));
+
+    result->len = 0;
+    result->is_leaf = is_leaf;
+    result->next = NULL;
+
+    return result;
+}
+
+// Get key of the map along with its prefix
+bmap_key_t bmap_key(const bmap_t* map, const void* key) {
+    bmap_key_t result = { { 0 }, key };
+
+    if (map->str_keys) {
+        const unsigned char* str = (const unsigned char*) key;
+        for (int i = 0; i < BMAP_PREFIX_WORDS * 8 && str[i]; i++)
+            result.prefix[i / 8] |= (uint64_t) str[i] << (56 - 8 * (i % 8));
+    }
+    return result;
+}
+
+// Compare a key to the one in a node, looking at the keys themselves only if their
+// prefixes are equal
+int bmap_node_keycmp(const bmap_key_t* key, const bmap_node_t* node, int idx, compfun_t comp) {
+    for (int w = 0; w < BMAP_PREFIX_WORDS; w++) {
+        if (key->prefix[w] != node->prefixes[w][idx])
+            return key->prefix[w] < node->prefixes[w][idx] ? -1 : 1;
+    }
+    return comp(key->key, node->keys[idx]);
+}
+
+bmap_key_t bmap_node_key(const bmap_node_t* node, int idx) {
+    bmap_key_t result;
+    for (int w = 0; w < BMAP_PREFIX_WORDS; w++)
+        result.prefix[w] = node->prefixes[w][idx];
+    result.key = node->keys[idx];
+    return result;
+}
+void bmap_node_set_key(bmap_node_t* node, int idx, bmap_key_t key) {
+    for (int w = 0; w < BMAP_PREFIX_WORDS; w++)
+        node->prefixes[w][idx] = key.prefix[w];
+    node->keys[idx] = key.key;
+}
+
+// Move len entries (ranges may overlap)
+void bmap_node_move(bmap_node_t* dst, int dst_idx, bmap_node_t* src, int src_idx, int len) {
+    for (int w = 0; w < BMAP_PREFIX_WORDS; w++)
+        memmove(dst->prefixes[w] + dst_idx, src->prefixes[w] + src_idx, sizeof(uint64_t) * len);
+    memmove(dst->keys + dst_idx, src->keys + src_idx, sizeof(void*) * len);
+    memmove(dst->slots + dst_idx, src->slots + src_idx, sizeof(void*) * len);
+}
+
+// Position of a key in a node: for leaves the first entry not less than the key
+// (*found_ret tells if it's equal), for inner nodes the child the key belongs to
+int bmap_node_find(const bmap_node_t* node, const bmap_key_t* key, compfun_t comp, int* found_ret) {
+    int lo = node->is_leaf ? 0 : 1;
+    int hi = node->len;
+
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        int comp_result = bmap_node_keycmp(key, node, mid, comp);
+
+        if (comp_result == 0) {
+            *found_ret = 1;
+            return mid;
+        }
+        if (comp_result < 0) hi = mid;
+        else                 lo = mid + 1;
+    }
+
+    *found_ret = 0;
+    return node->is_leaf ? lo : lo - 1;
+}
+
+// Walk down to the leaf where key is (or would be), returns 1 if it's there.
+//  NB. the map mustn't be empty
+int bmap_descend(const bmap_t* map, const bmap_key_t* key, bmap_path_t* path) {
+    bmap_node_t* node = map->root;
+    int found = 0;
+
+    path->depth = 0;
+    for (;;) {
+        int idx = bmap_node_find(node, key, map->comp, &found);
+
+        path->nodes[path->depth] = node;
+        path->idxs[path->depth] = idx;
+        path->depth++;
+
+        if (node->is_leaf) return found;
+        node = (bmap_node_t*) node->slots[idx];
+    }
+}
+
+// Get data associated with key, NULL if it's not there
+void* bmap_get(const bmap_t* map, const void* key) {
+    const bmap_node_t* node = map->root;
+    bmap_key_t wanted = bmap_key(map, key);
+    int found = 0;
+
+    while (node) {
+        int idx = bmap_node_find(node, &wanted, map->comp, &found);
+
+        if (node->is_leaf) return found ? node->slots[idx] : NULL;
+        node = (const bmap_node_t*) node->slots[idx];
+    }
+    return NULL;
+}
+
+// Put an entry in a node with room for it
+void bmap_node_put(bmap_node_t* node, int idx, bmap_key_t key, void* slot) {
+    assert(node->len < BMAP_FANOUT);
+
+    bmap_node_move(node, idx + 1, node, idx, node->len - idx);
+    bmap_node_set_key(node, idx, key);
+    node->slots[idx] = slot;
+    node->len++;
+}
+
+// Take an entry out of a node
+void bmap_node_take(bmap_node_t* node, int idx) {
+    bmap_node_move(node, idx, node, idx + 1, node->len - idx - 1);
+    node->len--;
+}
+
+// Update the keys standing for the node at the given level of the path in its
+// ancestors, after its smallest key changed
+void bmap_path_fix_min(bmap_path_t* path, int level) {
+    for (; level > 0; level--) {
+        bmap_node_t* parent = path->nodes[level - 1];
+        int idx = path->idxs[level - 1];
+
+        bmap_node_set_key(parent, idx, bmap_node_key(path->nodes[level], 0));
+        if (idx != 0) break;
+    }
+}
+
+// Insert a new entry where the path leads, splitting full nodes on the way up
+void bmap_insert_at(bmap_t* map, bmap_path_t* path, bmap_key_t key, void* data) {
+    int level = path->depth - 1;
+    int idx = path->idxs[level];
+    void* slot = data;
+
+    for (;;) {
+        bmap_node_t* node = path->nodes[level];
+
+        if (node->len < BMAP_FANOUT) {
+            bmap_node_put(node, idx, key, slot);
+            if (idx == 0) bmap_path_fix_min(path, level);
+            return;
+        }
+
+        // Split node in halves, the upper one going to the right
+        bmap_node_t* right = bmap_node_new(node->is_leaf);
+        right->len = BMAP_FANOUT - BMAP_MIN_LEN;
+        bmap_node_move(right, 0, node, BMAP_MIN_LEN, right->len);
+        node->len = BMAP_MIN_LEN;
+        if (node->is_leaf) {
+            right->next = node->next;
+            node->next = right;
+        }
+
+        if (idx <= BMAP_MIN_LEN) {
+            bmap_node_put(node, idx, key, slot);
+            if (idx == 0) bmap_path_fix_min(path, level);
+        } else {
+            bmap_node_put(right, idx - BMAP_MIN_LEN, key, slot);
+        }
+
+        // Root was split: grow a new one
+        if (level == 0) {
+            bmap_node_t* root = bmap_node_new(0);
+            bmap_node_put(root, 0, bmap_node_key(node, 0), node);
+            bmap_node_put(root, 1, bmap_node_key(right, 0), right);
+            map->root = root;
+            map->height++;
+            return;
+        }
+
+        // Link right half into the parent
+        key = bmap_node_key(right, 0);
+        slot = right;
+        level--;
+        idx = path->idxs[level] + 1;
+    }
+}
+
+// Get data associated with key, adding it (made by make_ele) if it's not there
+void* bmap_get_or(bmap_t* map, const void* key, map_ele_maker_fun_t make_ele) {
+    if (!map->root) {
+        map->root = bmap_node_new(1);
+        map->height = 1;
+    }
+
+    bmap_path_t path;
+    bmap_key_t wanted = bmap_key(map, key);
+    if (bmap_descend(map, &wanted, &path)) {
+        return path.nodes[path.depth - 1]->slots[path.idxs[path.depth - 1]];
+    }
+
+    void* result = make_ele();
+    wanted.key = map->clone_key(key);
+    bmap_insert_at(map, &path, wanted, result);
+    map->len++;
+
+    return result;
+}
+
+// Bring the node at the given level of the path back to the minimum fill, borrowing
+// entries from a sibling or merging with it. Returns 1 if the parent lost an entry
+int bmap_path_refill(bmap_path_t* path, int level) {
+    bmap_node_t* node = path->nodes[level];
+    bmap_node_t* parent = path->nodes[level - 1];
+    int idx = path->idxs[level - 1];
+    bmap_node_t* left = idx > 0 ? (bmap_node_t*) parent->slots[idx - 1] : NULL;
+    bmap_node_t* right = idx + 1 < parent->len ? (bmap_node_t*) parent->slots[idx + 1] : NULL;
+
+    if (left && left->len > BMAP_MIN_LEN) {
+        bmap_node_put(node, 0, bmap_node_key(left, left->len - 1), left->slots[left->len - 1]);
+        left->len--;
+        bmap_node_set_key(parent, idx, bmap_node_key(node, 0));
+        return 0;
+    }
+    if (right && right->len > BMAP_MIN_LEN) {
+        bmap_node_put(node, node->len, bmap_node_key(right, 0), right->slots[0]);
+        bmap_node_take(right, 0);
+        bmap_node_set_key(parent, idx + 1, bmap_node_key(right, 0));
+        return 0;
+    }
+
+    // Merge with a sibling, always into the left one of the pair
+    bmap_node_t* into = left ? left : node;
+    bmap_node_t* from = left ? node : right;
+    int from_idx = left ? idx : idx + 1;
+
+    bmap_node_move(into, into->len, from, 0, from->len);
+    into->len += from->len;
+    into->next = from->next;
+    slab_free(from, sizeof(bmap_node_t));
+
+    bmap_node_take(parent, from_idx);
+    return 1;
+}
+
+// Remove the entry where the path leads, deallocating it
+void bmap_remove_at(bmap_t* map, bmap_path_t* path) {
+    int level = path->depth - 1;
+    bmap_node_t* leaf = path->nodes[level];
+    int idx = path->idxs[level];
+
+    map->free_key((void*) leaf->keys[idx]);
+    map->free_element(leaf->slots[idx]);
+    bmap_node_take(leaf, idx);
+    map->len--;
+
+    if (idx == 0 && leaf->len > 0) bmap_path_fix_min(path, level);
+
+    while (level > 0 && path->nodes[level]->len < BMAP_MIN_LEN && bmap_path_refill(path, level))
+        level--;
+
+    // Shrink root if it's left with a single child (or nothing at all)
+    bmap_node_t* root = map->root;
+    if (!root->is_leaf && root->len == 1) {
+        map->root = (bmap_node_t*) root->slots[0];
+        map->height--;
+        slab_free(root, sizeof(bmap_node_t));
+    } else if (root->len == 0) {
+        map->root = NULL;
+        map->height = 0;
+        slab_free(root, sizeof(bmap_node_t));
+    }
+}
+
+// Remove an element from a given map
+int bmap_remove(bmap_t* map, const void* key) {
+    bmap_path_t path;
+    bmap_key_t wanted = bmap_key(map, key);
+
+    if (!map->root || !bmap_descend(map, &wanted, &path))
+        return MAP_OPERATION_FAILED;
+
+    bmap_remove_at(map, &path);
+    return MAP_OK;
+}
+
+// Fill empty map with elements whose keys are distinct and sorted according to the map,
+// one level at a time, without comparing anything
+void bmap_fill_sorted(bmap_t* map, const void** keys, void** data, int len) {
+    assert(map->len == 0 && !map->root);
+    if (len == 0) return;
+
+    bmap_node_t** level = malloc(sizeof(bmap_node_t*) * ((len + BMAP_MIN_LEN - 1) / BMAP_MIN_LEN));
+    if (!level) ERROR("Out of memory\n");
+
+    // Entries are spread evenly among the nodes of every level, which keeps them filled
+    // at least to BMAP_MIN_LEN
+    int level_len = len;
+    for (int is_leaf = 1; is_leaf || level_len > 1; is_leaf = 0) {
+        int nodes_len = (level_len + BMAP_FANOUT - 1) / BMAP_FANOUT;
+        int taken = 0;
+
+        for (int i = 0; i < nodes_len; i++) {
+            bmap_node_t* node = bmap_node_new(is_leaf);
+            node->len = level_len / nodes_len + (i < level_len % nodes_len);
+
+            for (int j = 0; j < node->len; j++) {
+                if (is_leaf) {
+                    bmap_node_set_key(node, j, bmap_key(map, map->clone_key(keys[taken + j])));
+                    node->slots[j] = data[taken + j];
+                } else {
+                    bmap_node_set_key(node, j, bmap_node_key(level[taken + j], 0));
+                    node->slots[j] = level[taken + j];
+                }
+            }
+            taken += node->len;
+
+            // Children were all read already, so their slot can be reused
+            if (is_leaf && i > 0) level[i - 1]->next = node;
+            level[i] = node;
+        }
+
+        level_len = nodes_len;
+        map->height++;
+    }
+
+    map->root = level[0];
+    map->len = len;
+    free(level);
+}
+
+// Deallocate subtree, recursion depth is the height of the tree
+void bmap_node_free(const bmap_t* map, bmap_node_t* node) {
+    for (int i = 0; i < node->len; i++) {
+        if (node->is_leaf) {
+            map->free_key((void*) node->keys[i]);
+            map->free_element(node->slots[i]);
+        } else {
+            bmap_node_free(map, (bmap_node_t*) node->slots[i]);
+        }
+    }
+    slab_free(node, sizeof(bmap_node_t));
+}
+void bmap_free(bmap_t* map) {
+    if (map->root) bmap_node_free(map, map->root);
+    slab_free(map, sizeof(bmap_t));
+}
+
+// In order map iterator. Usage:
+//  for (bmap_iter_t it = bmap_iter(map); bmap_iter_next(&it);) { ... it.key, it.data ... }
+typedef struct bmap_iter_t_ {
+    const bmap_node_t* leaf;
+    int idx;
+    const void* key;    // current entry, set by bmap_iter_next
+    void* data;
+} bmap_iter_t;
+
+// Get iterator positioned before the first element of the map
+bmap_iter_t bmap_iter(const bmap_t* map) {
+    const bmap_node_t* node = map->root;
+    while (node && !node->is_leaf)
+        node = (const bmap_node_t*) node->slots[0];
+
+    bmap_iter_t result = { node, -1, NULL, NULL };
+    return result;
+}
+
+// Advance iterator, returns 0 once past the last element
+int bmap_iter_next(bmap_iter_t* iter) {
+    iter->idx++;
+    while (iter->leaf && iter->idx >= iter->leaf->len) {
+        iter->leaf = iter->leaf->next;
+        iter->idx = 0;
+    }
+    if (!iter->leaf) return 0;
+
+    iter->key = iter->leaf->keys[iter->idx];
+    iter->data = iter->leaf->slots[iter->idx];
+    return 1;
+}
+
+// Print the contents of a map in order (see map_print_with)
+int bmap_print_with(FILE* out_f, const bmap_t* map,
+        printer_fun_t print_key,
+        printer_fun_t print_ele,
+        int print_mode) {
+    if (!map)
+        return MAP_ERR_NULL_MAP;
+
+    if (print_mode == PRINT_MODE_DB || print_mode == PRINT_MODE_SET)
+        fputs("{ ", out_f);
+
+    for (bmap_iter_t it = bmap_iter(map); bmap_iter_next(&it);) {
+        if (print_mode == PRINT_MODE_DB) fputs("(", out_f);
+        print_key(out_f, it.key);
+        if (print_mode == PRINT_MODE_DB) fputs(": ", out_f);
+        print_ele(out_f, it.data);
+        if (print_mode == PRINT_MODE_DB) fputs(") ", out_f);
+        else if (print_mode == PRINT_MODE_SET) fputs(", ", out_f);
+    }
+
+    if (print_mode == PRINT_MODE_DB || print_mode == PRINT_MODE_SET)
+        fputs("}", out_f);
+
+    return MAP_OK;
+}
+
+/*************************************************************************/
+/* Hash table of strings. Open addressing with linear probing; keys are  */
+/* stored along with their hash so that probes rarely touch the strings. */
+/* Used where lookups never need ordering (interning pool, entities).    */
+/*************************************************************************/
+#define STRTAB_MIN_CAP 64
+
+// Hash a string, processing it one word at a time
+uint32_t str_hash(const char* str, size_t len) {
+    uint64_t hash = 0x9e3779b97f4a7c15ULL ^ len;
+
+    while (len >= sizeof(uint64_t)) {
+        uint64_t word;
+        memcpy(&word, str, sizeof(uint64_t));
+        hash = (hash ^ word) * 0xff51afd7ed558ccdULL;
+        hash ^= hash >> 32;
+
+        str += sizeof(uint64_t);
+        len -= sizeof(uint64_t);
+    }
+
+    uint64_t tail = 0;
+    memcpy(&tail, str, len);
+    hash = (hash ^ tail) * 0xc4ceb9fe1a85ec53ULL;
+    hash ^= hash >> 29;
+
+    return (uint32_t) hash;
+}
+
+typedef struct strtab_slot_t_ {
+    const char* key;  // NULL for free slots
+    void* data;
+    uint32_t hash;
+} strtab_slot_t;
+
+typedef struct strtab_t_ {
+    strtab_slot_t* slots;
+    int cap;          // always a power of two
+    int len;
+    key_cloner_fun_t clone_key;
+    free_key_fun_t free_key;
+    free_element_fun_t free_element;
+} strtab_t;
+
+// Allocate empty table
+strtab_t* strtab_empty(key_cloner_fun_t clone_key, free_key_fun_t free_key, free_element_fun_t free_element) {
+    strtab_t* result = slab_alloc(sizeof(strtab_t));
+
+    result->cap = STRTAB_MIN_CAP;
+    result->len = 0;
+    result->slots = calloc(result->cap, sizeof(strtab_slot_t));
+    if (!result->slots) ERROR("Out of memory for hash table");
+    result->clone_key = clone_key;
+    result->free_key = free_key;
+    result->free_element = free_element;
+
+    return result;
+}
+
+// Remove everything from the table, keeping its capacity
+void strtab_clear(strtab_t* tab) {
+    for (int i = 0; i < tab->cap; i++) {
+        if (tab->slots[i].key) {
+            tab->free_key((void*) tab->slots[i].key);
+            tab->free_element(tab->slots[i].data);
+            tab->slots[i].key = NULL;
+        }
+    }
+
+    tab->len = 0;
+}
+
+// Free table and everything it contains
+void strtab_free(strtab_t* tab) {
+    strtab_clear(tab);
+
+    free(tab->slots);
+    slab_free(tab, sizeof(strtab_t));
+}
+
+// Find the slot holding key (compared by address), NULL if absent
+strtab_slot_t* strtab_lookup(const strtab_t* tab, const char* key, uint32_t hash) {
+    int mask = tab->cap - 1;
+
+    for (int i = hash & mask; tab->slots[i].key; i = (i + 1) & mask) {
+        if (tab->slots[i].key == key) {
+            return &(tab->slots[i]);
+        }
+    }
+
+    return NULL;
+}
+
+// Find the slot holding a key equal to a string slice, NULL if absent
+strtab_slot_t* strtab_lookup_slice(const strtab_t* tab, slice_t str, uint32_t hash) {
+    int mask = tab->cap - 1;
+
+    for (int i = hash & mask; tab->slots[i].key; i = (i + 1) & mask) {
+        const strtab_slot_t* slot = &(tab->slots[i]);
+        if (slot->hash == hash && strncmp(slot->key, str.ptr, str.len) == 0 && slot->key[str.len] == '\0') {
+            return &(tab->slots[i]);
+        }
+    }
+
+    return NULL;
+}
+
+// Get data associated with key, NULL if absent
+void* strtab_get(const strtab_t* tab, const char* key, uint32_t hash) {
+    strtab_slot_t* slot = strtab_lookup(tab, key, hash);
+    return slot ? slot->data : NULL;
+}
+
+// Put a slot in the first free position of its probe sequence
+void strtab_place(strtab_t* tab, strtab_slot_t slot) {
+    int mask = tab->cap - 1;
+
+    int i = slot.hash & mask;
+    while (tab->slots[i].key) {
+        i = (i + 1) & mask;
+    }
+
+    tab->slots[i] = slot;
+}
+
+// Double table capacity, rehashing from the stored hashes
+void strtab_grow(strtab_t* tab) {
+    strtab_slot_t* old_slots = tab->slots;
+    int old_cap = tab->cap;
+
+    tab->cap *= 2;
+    tab->slots = calloc(tab->cap, sizeof(strtab_slot_t));
+    if (!tab->slots) ERROR("Out of memory for hash table");
+
+    for (int i = 0; i < old_cap; i++) {
+        if (old_slots[i].key) {
+            strtab_place(tab, old_slots[i]);
+        }
+    }
+
+    free(old_slots);
+}
+
+// Add (key: data) to the table. Fails if key is already present
+int strtab_add(strtab_t* tab, const char* key, uint32_t hash, void* data) {
+    if (strtab_lookup(tab, key, hash)) {
+        return MAP_OPERATION_FAILED;
+    }
+
+    // Keep load factor at most 1/2, probe sequences stay short
+    if (2 * (tab->len + 1) > tab->cap) {
+        strtab_grow(tab);
+    }
+
+    strtab_slot_t slot = { (const char*) tab->clone_key((const void*) key), data, hash };
+    strtab_place(tab, slot);
+    tab->len++;
+
+    return MAP_OK;
+}
+
+// Get data associated with key, adding a new element made with maker if absent
+void* strtab_get_or(strtab_t* tab, const char* key, uint32_t hash, map_ele_maker_fun_t maker) {
+    strtab_slot_t* slot = strtab_lookup(tab, key, hash);
+    if (slot) {
+        return slot->data;
+    }
+
+    void* data = maker();
+    int add_res = strtab_add(tab, key, hash, data);
+    assert(add_res == MAP_OK);
+    (void) add_res;
+
+    return data;
+}
+
+// Remove slot from the table, freeing its key and returning its data. Entries following
+// it in the same probe run are shifted back, so that no tombstones are needed
+void* strtab_take_slot(strtab_t* tab, strtab_slot_t* slot) {
+    int mask = tab->cap - 1;
+    void* data = slot->data;
+
+    tab->free_key((void*) slot->key);
+    tab->len--;
+
+    int hole = (int) (slot - tab->slots);
+    for (int i = (hole + 1) & mask; tab->slots[i].key; i = (i + 1) & mask) {
+        // An entry may fill the hole only if its home position isn't in (hole, i]
+        int home = tab->slots[i].hash & mask;
+        int home_dist = (i - home) & mask;
+        int hole_dist = (i - hole) & mask;
+        if (home_dist >= hole_dist) {
+            tab->slots[hole] = tab->slots[i];
+            hole = i;
+        }
+    }
+
+    tab->slots[hole].key = NULL;
+
+    return data;
+}
+
+// Remove slot from the table, freeing its content
+void strtab_remove_slot(strtab_t* tab, strtab_slot_t* slot) {
+    tab->free_element(strtab_take_slot(tab, slot));
+}
+
+// Remove key from the table
+int strtab_remove(strtab_t* tab, const char* key, uint32_t hash) {
+    strtab_slot_t* slot = strtab_lookup(tab, key, hash);
+    if (!slot) {
+        return MAP_OPERATION_FAILED;
+    }
+
+    strtab_remove_slot(tab, slot);
+    return MAP_OK;
+}
+
+// Order slots by key name (qsort style)
+int strtab_slot_cmp(const void* lhs, const void* rhs) {
+    return strcmp(((const strtab_slot_t*) lhs)->key, ((const strtab_slot_t*) rhs)->key);
+}
+
+// Print table in name order, same format as map_print_with
+int strtab_print_with(FILE* out_f, const strtab_t* tab,
+        printer_fun_t print_key,
+        printer_fun_t print_ele,
+        int print_mode) {
+    if (!tab)
+        return MAP_ERR_NULL_MAP;
+
+    // Snapshot occupied slots and sort them
+    strtab_slot_t* sorted = malloc(sizeof(strtab_slot_t) * (tab->len > 0 ? tab->len : 1));
+    if (!sorted) ERROR("Out of memory for hash table printing");
+
+    int len = 0;
+    for (int i = 0; i < tab->cap; i++) {
+        if (tab->slots[i].key) {
+            sorted[len++] = tab->slots[i];
+        }
+    }
+    qsort(sorted, len, sizeof(strtab_slot_t), &strtab_slot_cmp);
+
+    if (print_mode == PRINT_MODE_DB || print_mode == PRINT_MODE_SET)
+        fputs("{ ", out_f);
+
+    for (int i = 0; i < len; i++) {
+        if (print_mode == PRINT_MODE_DB) fputs("(", out_f);
+        print_key(out_f, sorted[i].key);
+        if (print_mode == PRINT_MODE_DB) fputs(": ", out_f);
+        print_ele(out_f, sorted[i].data);
+        if (print_mode == PRINT_MODE_DB) fputs(") ", out_f);
+        else if (print_mode == PRINT_MODE_SET) fputs(", ", out_f);
+    }
+
+    if (print_mode == PRINT_MODE_DB || print_mode == PRINT_MODE_SET)
+        fputs("}", out_f);
+
+    free(sorted);
+
+    return MAP_OK;
+}
+
+/************************************************************************/
+/* String interning pool. Every entity and relation id is stored once;  */
+/* maps hold handles to the pooled copy, so equal ids share a pointer.  */
+/************************************************************************/
+// Pool entry. Handles point to str, whose terminator is followed by the quoted form of
+// the string as it appears in reports (i.e. "str" followed by a space)
+typedef struct intern_entry_t_ {
+    int refs;       // number of map keys (or in-flight commands) holding the handle
+    int len;        // length of str
+    uint32_t hash;  // str_hash of str, reused by every table keyed by the handle
+    char str[];
+} intern_entry_t;
+
+// Size of pool entry holding string of given length
+size_t intern_entry_size(size_t len) {
+    return sizeof(intern_entry_t) + (len + 1) + (len + 3); // terminator, quotes and space
+}
+
+// Global pool of (str: intern_entry_t)
+strtab_t* intern_pool = NULL;
+
+// Get pool entry associated with a handle
+intern_entry_t* intern_entry_of(const char* handle) {
+    return (intern_entry_t*) (handle - offsetof(intern_entry_t, str));
+}
+
+// Custom free function for pool entries
+void intern_entry_free(void* to_free_v) {
+    intern_entry_t* to_free = (intern_entry_t*) to_free_v;
+    slab_free(to_free, intern_entry_size(to_free->len));
+}
+
+// Allocate empty interning pool
+strtab_t* intern_pool_empty() {
+    // Entries own their key, so keys are neither cloned nor freed separately
+    return strtab_empty(&shallow_cloner, &do_nothing, &intern_entry_free);
+}
+
+// Get hash of an interned string
+uint32_t handle_hash(const char* handle) {
+    return intern_entry_of(handle)->hash;
+}
+
+// Lookup helper for intern_find and intern_acquire
+const char* intern_find_hashed(slice_t str, uint32_t hash) {
+    strtab_slot_t* slot = strtab_lookup_slice(intern_pool, str, hash);
+    return slot ? slot->key : NULL;
+}
+
+// Get handle for str if it is interned, NULL otherwise. The returned handle is borrowed
+const char* intern_find(slice_t str) {
+    return intern_find_hashed(str, str_hash(str.ptr, str.len));
+}
+
+// Take a reference on a handle
+const char* intern_ref(const char* handle) {
+    if (handle) intern_entry_of(handle)->refs++;
+    return handle;
+}
+
+// Get handle for str, interning it if needed. The caller owns a reference to it
+const char* intern_acquire(slice_t str) {
+    uint32_t hash = str_hash(str.ptr, str.len);
+    const char* handle = intern_find_hashed(str, hash);
+
+    if (!handle) {
+        intern_entry_t* entry = slab_alloc(intern_entry_size(str.len));
+        entry->refs = 0;
+        entry->len = (int) str.len;
+        entry->hash = hash;
+        memcpy(entry->str, str.ptr, str.len);
+        entry->str[str.len] = '\0';
+
+        // Pre-render quoted form
+        char* quoted = entry->str + str.len + 1;
+        quoted[0] = '"';
+        memcpy(quoted + 1, str.ptr, str.len);
+        quoted[str.len + 1] = '"';
+        quoted[str.len + 2] = ' ';
+
+        int add_res = strtab_add(intern_pool, entry->str, hash, (void*) entry);
+        assert(add_res == MAP_OK);
+        (void) add_res;
+
+        handle = entry->str;
+    }
+
+    return intern_ref(handle);
+}
+
+// Drop a reference to a handle, removing it from the pool once unreferenced
+void intern_release(const char* handle) {
+    if (!handle) return;
+
+    intern_entry_t* entry = intern_entry_of(handle);
+    assert(entry->refs > 0);
+
+    if (--entry->refs == 0) {
+        int removal_res = strtab_remove(intern_pool, handle, entry->hash);
+        assert(removal_res == MAP_OK);
+        (void) removal_res;
+    }
+}
+
+// Map key cloner for interned strings (only takes a reference)
+const void* handle_cloner(const void* to_clone) {
+    return (const void*) intern_ref((const char*) to_clone);
+}
+
+// Map key deallocator for interned strings
+void handle_free(void* to_free) {
+    intern_release((const char*) to_free);
+}
+
+// Orders handles by name, equal handles are detected without touching the strings
+int handlecmp(const void* lhs, const void* rhs) {
+    return lhs == rhs ? 0 : strcmp((const char*) lhs, (const char*) rhs);
+}
+
+// Orders handles by address. Used by maps that are only queried by key
+int ptrcmp(const void* lhs, const void* rhs) {
+    return lhs == rhs ? 0 : (lhs < rhs ? -1 : 1);
+}
+
+/****************************************************************************/
+/* Entities. Every entity gets a dense integer id at creation, which is     */
+/* what relation tx sets store. Ids of deleted entities are recycled.       */
+/****************************************************************************/
+typedef struct entity_t_ {
+    const char* name;   // interned handle (the reference is owned by the entities map key)
+    int id;
+    map_t* incidence[]; // maps of (rel id: incid_t), relations the entity takes part in.
+                        // One for each relation shard, each only touched by its shard
+} entity_t;
+
+// Number of relation shards (see engine_t), 0 when relations are not sharded.
+//  NB. maps owned by shards don't take references on their (interned) keys
+int shard_count = 0;
+
+// Shard served by the calling thread
+__thread int shard_self = 0;
+
+// Amount of incidence maps of every entity
+size_t entity_size() {
+    return sizeof(entity_t) + sizeof(map_t*) * (shard_count ? shard_count : 1);
+}
+
+// Incidence map of an entity in the shard served by the calling thread
+map_t* ent_incidence(const entity_t* entity) {
+    return entity->incidence[shard_self];
+}
+
+// Registry of live entities indexed by id
+typedef struct ent_registry_t_ {
+    entity_t** by_id;
+    int* free_ids;    // stack of recyclable ids
+    int free_len;
+    int next_id;      // lowest id never handed out
+    int cap;          // capacity of both by_id and free_ids
+} ent_registry_t;
+
+ent_registry_t ent_registry = { NULL, NULL, 0, 0, 0 };
+
+// Allocate entity, assigning it the most recently freed id (or a new one if none is free)
+void incid_vfree(void* to_free);
+entity_t* entity_at(int id);
+entity_t* entity_empty() {
+    int id;
+
+    if (ent_registry.free_len > 0) {
+        id = ent_registry.free_ids[--ent_registry.free_len];
+    } else {
+        if (ent_registry.next_id == ent_registry.cap) {
+            ent_registry.cap = ent_registry.cap ? ent_registry.cap * 2 : 64;
+            ent_registry.by_id = realloc(ent_registry.by_id, sizeof(entity_t*) * ent_registry.cap);
+            ent_registry.free_ids = realloc(ent_registry.free_ids, sizeof(int) * ent_registry.cap);
+        }
+        id = ent_registry.next_id++;
+    }
+
+    return entity_at(id);
+}
+
+// Allocate entity with a given id, which must have been handed out by the registry
+entity_t* entity_at(int id) {
+    assert(id >= 0 && id < ent_registry.next_id);
+
+    entity_t* result = slab_alloc(entity_size());
+    result->name = NULL;
+    result->id = id;
+    for (int i = 0; i < (shard_count ? shard_count : 1); i++) {
+        result->incidence[i] = shard_count
+            ? map_empty(&ptrcmp, &shallow_cloner, &disallow_duplicates, &do_nothing, &incid_vfree)
+            : map_empty(&ptrcmp, &handle_cloner, &disallow_duplicates, &handle_free, &incid_vfree);
+    }
+
+    ent_registry.by_id[id] = result;
+
+    return result;
+}
+void* v_entity_empty() {
+    return (void*) entity_empty();
+}
+
+// Custom free function, also giving back the entity id
+void entity_free(void* to_free_v) {
+    entity_t* to_free = (entity_t*) to_free_v;
+
+    ent_registry.by_id[to_free->id] = NULL;
+    ent_registry.free_ids[ent_registry.free_len++] = to_free->id;
+
+    for (int i = 0; i < (shard_count ? shard_count : 1); i++)
+        map_free(to_free->incidence[i]);
+    slab_free(to_free, entity_size());
+}
+
+// Get live entity from its id
+entity_t* entity_of_id(int id) {
+    assert(id >= 0 && id < ent_registry.next_id);
+    return NOTNULL(ent_registry.by_id[id]);
+}
+
+// Deallocate registry storage
+void ent_registry_free() {
+    free(ent_registry.by_id);
+    free(ent_registry.free_ids);
+    ent_registry = (ent_registry_t) { NULL, NULL, 0, 0, 0 };
+}
+
+// Reset empty registry so that ids in [0, next_id) are handed out, to be taken with
+// entity_at. Ids left untaken are made free by ent_registry_collect_free
+void ent_registry_restore(int next_id) {
+    assert(!ent_registry.by_id);
+
+    ent_registry.cap = next_id > 64 ? next_id : 64;
+    ent_registry.by_id = calloc(ent_registry.cap, sizeof(entity_t*));
+    ent_registry.free_ids = malloc(sizeof(int) * ent_registry.cap);
+    if (!ent_registry.by_id || !ent_registry.free_ids) ERROR("Out of memory for entity registry\n");
+    ent_registry.next_id = next_id;
+}
+void ent_registry_collect_free() {
+    // Lowest ids end up on top of the stack
+    ent_registry.free_len = 0;
+    for (int id = ent_registry.next_id - 1; id >= 0; id--) {
+        if (!ent_registry.by_id[id])
+            ent_registry.free_ids[ent_registry.free_len++] = id;
+    }
+}
+
+// Printer for entities map entries
+void entity_printer(FILE* out_f, const void* to_print) {
+    fprintf(out_f, "#%d", ((const entity_t*) to_print)->id);
+}
+
+/******************************************************************************/
+/* Set of entity ids. Small sets keep their ids inline, larger ones in a      */
+/* sorted id vector while sparse, and in a bitset over [0, span) once ids are */
+/* dense enough for it to be smaller.                                         */
+/******************************************************************************/
+#define IDSET_WORD_BITS 64
+// Sets with up to this many members keep them inline, in place of the vector
+// pointer. Vectors go back inline once they shrink to half that, so that sets
+// hovering around the threshold do not flip-flop.
+#define IDSET_INLINE 4
+// Vectors with at least this many members become bitsets once the id span is
+// at most IDSET_DENSITY times their length. Bitsets go back to vectors at half
+// that density, for the same reason.
+#define IDSET_MIN_BITSET_LEN 16
+#define IDSET_DENSITY 32
+
+typedef struct idset_t_ {
+    int len;        // number of members
+    int cap;        // capacity in ids (vector) or in words (bitset)
+    int is_bitset;
+    union {
+        int* ids;                        // sorted member ids (cap > IDSET_INLINE)
+        int inline_ids[IDSET_INLINE];    // sorted member ids (cap == IDSET_INLINE)
+        uint64_t* words;                 // membership bits
+    };
+} idset_t;
+
+// Sorted member ids of a vector set
+#define IDSET_IDS(set) ((set)->cap > IDSET_INLINE ? (set)->ids : (set)->inline_ids)
+
+// Initialize empty id set in place (sets are embedded in their owners)
+void idset_init(idset_t* set) {
+    set->len = 0;
+    set->cap = IDSET_INLINE;
+    set->is_bitset = 0;
+}
+
+// Free the members of a set initialized with idset_init
+void idset_release(idset_t* set) {
+    if (set->is_bitset)                slab_free(set->words, sizeof(uint64_t) * set->cap);
+    else if (set->cap > IDSET_INLINE)  slab_free(set->ids, sizeof(int) * set->cap);
+}
+
+// Index of first member not lower than id in a vector set
+int idset_lower_bound(const idset_t* set, int id) {
+    const int* ids = IDSET_IDS(set);
+    int lo = 0, hi = set->len;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (ids[mid] < id) lo = mid + 1;
+        else               hi = mid;
+    }
+    return lo;
+}
+
+// Switch between representations
+void idset_to_bitset(idset_t* set, int span) {
+    int words_len = (span + IDSET_WORD_BITS - 1) / IDSET_WORD_BITS;
+    uint64_t* words = slab_alloc(sizeof(uint64_t) * words_len);
+    memset(words, 0, sizeof(uint64_t) * words_len);
+
+    const int* ids = IDSET_IDS(set);
+    for (int i = 0; i < set->len; i++)
+        words[ids[i] / IDSET_WORD_BITS] |= (uint64_t) 1 << (ids[i] % IDSET_WORD_BITS);
+
+    idset_release(set);
+    set->words = words;
+    set->cap = words_len;
+    set->is_bitset = 1;
+}
+void idset_to_vector(idset_t* set) {
+    // Leave room for one more member, as the set is converted right before
+    // adding one when it becomes too sparse
+    int cap = set->len + 1 <= IDSET_INLINE ? IDSET_INLINE : set->len + 1;
+    int inline_ids[IDSET_INLINE];
+    int* ids = cap > IDSET_INLINE ? slab_alloc(sizeof(int) * cap) : inline_ids;
+    int ids_len = 0;
+
+    for (int w = 0; w < set->cap; w++)
+        for (uint64_t bits = set->words[w]; bits; bits &= bits - 1)
+            ids[ids_len++] = w * IDSET_WORD_BITS + __builtin_ctzll(bits);
+    assert(ids_len == set->len);
+
+    slab_free(set->words, sizeof(uint64_t) * set->cap);
+    if (cap > IDSET_INLINE) set->ids = ids;
+    else                    memcpy(set->inline_ids, inline_ids, sizeof(int) * ids_len);
+    set->cap = cap;
+    set->is_bitset = 0;
+}
+void idset_to_inline(idset_t* set) {
+    int* ids = set->ids;
+
+    memcpy(set->inline_ids, ids, sizeof(int) * set->len);
+    slab_free(ids, sizeof(int) * set->cap);
+    set->cap = IDSET_INLINE;
+}
+
+// 1 if id is in the set, 0 otherwise
+int idset_contains(const idset_t* set, int id) {
+    if (set->is_bitset) {
+        return id / IDSET_WORD_BITS < set->cap &&
+            (set->words[id / IDSET_WORD_BITS] >> (id % IDSET_WORD_BITS)) & 1;
+    } else {
+        int pos = idset_lower_bound(set, id);
+        return pos < set->len && IDSET_IDS(set)[pos] == id;
+    }
+}
+
+// Fill empty set with strictly increasing ids
+void idset_fill_sorted(idset_t* set, const int* ids, int len) {
+    assert(set->len == 0 && set->cap == IDSET_INLINE && !set->is_bitset);
+    if (len == 0) return;
+
+    if (len > IDSET_INLINE) {
+        set->ids = slab_alloc(sizeof(int) * len);
+        set->cap = len;
+    }
+    memcpy(IDSET_IDS(set), ids, sizeof(int) * len);
+    set->len = len;
+
+    // Convert to bitset if dense enough
+    int span = ids[len - 1] + 1;
+    if (len >= IDSET_MIN_BITSET_LEN && span <= IDSET_DENSITY * len)
+        idset_to_bitset(set, span);
+}
+
+// Add id to set. Signals failed insertion for duplicates like set_add
+int idset_add(idset_t* set, int id) {
+    assert(id >= 0);
+
+    if (set->is_bitset) {
+        int word = id / IDSET_WORD_BITS;
+
+        if (word >= set->cap) {
+            // Too sparse to keep growing the bitset
+            if ((word + 1) * IDSET_WORD_BITS > 2 * IDSET_DENSITY * (set->len + 1)) {
+                idset_to_vector(set);
+                return idset_add(set, id);
+            }
+
+            int new_cap = word + 1 + (word + 1) / 4;
+            set->words = slab_realloc(set->words, sizeof(uint64_t) * set->cap, sizeof(uint64_t) * new_cap);
+            memset(set->words + set->cap, 0, sizeof(uint64_t) * (new_cap - set->cap));
+            set->cap = new_cap;
+        }
+
+        uint64_t bit = (uint64_t) 1 << (id % IDSET_WORD_BITS);
+        if (set->words[word] & bit)
+            return MAP_OPERATION_FAILED;
+
+        set->words[word] |= bit;
+        set->len++;
+        return MAP_OK;
+    }
+
+    int pos = idset_lower_bound(set, id);
+    if (pos < set->len && IDSET_IDS(set)[pos] == id)
+        return MAP_OPERATION_FAILED;
+
+    if (set->len == set->cap) {
+        int new_cap = set->cap * 2;
+        if (set->cap > IDSET_INLINE) {
+            set->ids = slab_realloc(set->ids, sizeof(int) * set->cap, sizeof(int) * new_cap);
+        } else {
+            // Move inline ids out to a vector
+            int* ids = slab_alloc(sizeof(int) * new_cap);
+            memcpy(ids, set->inline_ids, sizeof(int) * set->len);
+            set->ids = ids;
+        }
+        set->cap = new_cap;
+    }
+    int* ids = IDSET_IDS(set);
+    memmove(ids + pos + 1, ids + pos, sizeof(int) * (set->len - pos));
+    ids[pos] = id;
+    set->len++;
+
+    // Convert to bitset if dense enough
+    int span = ids[set->len - 1] + 1;
+    if (set->len >= IDSET_MIN_BITSET_LEN && span <= IDSET_DENSITY * set->len)
+        idset_to_bitset(set, span);
+
+    return MAP_OK;
+}
+
+// Remove id from set
+int idset_remove(idset_t* set, int id) {
+    if (!idset_contains(set, id))
+        return MAP_OPERATION_FAILED;
+
+    set->len--;
+
+    if (set->is_bitset) {
+        set->words[id / IDSET_WORD_BITS] &= ~((uint64_t) 1 << (id % IDSET_WORD_BITS));
+
+        if (set->len < IDSET_MIN_BITSET_LEN / 2 ||
+                set->cap * IDSET_WORD_BITS > 2 * IDSET_DENSITY * set->len)
+            idset_to_vector(set);
+    } else {
+        int* ids = IDSET_IDS(set);
+        int pos = idset_lower_bound(set, id);
+        memmove(ids + pos, ids + pos + 1, sizeof(int) * (set->len - pos));
+
+        if (set->cap > IDSET_INLINE && set->len <= IDSET_INLINE / 2)
+            idset_to_inline(set);
+    }
+
+    return MAP_OK;
+}
+
+// Allocate array holding a snapshot of the members of the set (in id order)
+int* idset_members(const idset_t* set) {
+    int* result = malloc(sizeof(int) * (set->len + 1));
+
+    if (set->is_bitset) {
+        int result_len = 0;
+        for (int w = 0; w < set->cap; w++)
+            for (uint64_t bits = set->words[w]; bits; bits &= bits - 1)
+                result[result_len++] = w * IDSET_WORD_BITS + __builtin_ctzll(bits);
+    } else if (set->len > 0) {
+        memcpy(result, IDSET_IDS(set), sizeof(int) * set->len);
+    }
+
+    return result;
+}
+
+// Used to print id sets (as entity names) in maps
+void idset_printer(FILE* out_f, const void* to_print) {
+    const idset_t* set = (const idset_t*) to_print;
+
+    fputs("{ ", out_f);
+    if (set->is_bitset) {
+        for (int w = 0; w < set->cap; w++)
+            for (uint64_t bits = set->words[w]; bits; bits &= bits - 1)
+                fprintf(out_f, "%s, ",
+                        entity_of_id(w * IDSET_WORD_BITS + __builtin_ctzll(bits))->name);
+    } else {
+        for (int i = 0; i < set->len; i++)
+            fprintf(out_f, "%s, ", entity_of_id(IDSET_IDS(set)[i])->name);
+    }
+    fputs("}", out_f);
+}
+
+/***************************************************************************/
+/* Incidence index. Tells, for each entity, which relations it takes part  */
+/* in and how, so that deleting it doesn't need to scan every relation.    */
+/***************************************************************************/
+struct relinfo_t_;
+
+typedef struct incid_t_ {
+    struct relinfo_t_* relinfo; // relation the entity takes part in
+    idset_t rxs;                // ids of the entities it's transmitting to
+    int is_rx;                  // 1 if the entity has a tx set in relinfo
+} incid_t;
+
+// Allocate empty incidence
+incid_t* incid_empty() {
+    incid_t* result = slab_alloc(sizeof(incid_t));
+
+    result->relinfo = NULL;
+    idset_init(&result->rxs);
+    result->is_rx = 0;
+
+    return result;
+}
+void* v_incid_empty() {
+    return (void*) incid_empty();
+}
+
+// Custom free function
+void incid_vfree(void* to_free_v) {
+    incid_t* to_free = (incid_t*) to_free_v;
+
+    idset_release(&to_free->rxs);
+    slab_free(to_free, sizeof(incid_t));
+}
+
+/***************************************************************************/
+/* Rx entries of a relation, bucketed by their amount of tx entities. Rx   */
+/* entries are linked in place, so moving one across buckets, as well as   */
+/* finding the highest bucket, costs amortized O(1).                        */
+/***************************************************************************/
+typedef struct rxinfo_t_ {
+    const char* name;          // interned handle (the reference is owned by rxing_ents_map key)
+    idset_t txs;               // ids of the entities transmitting to this one
+    struct rxinfo_t_* prev;    // links to neighbours in the amount bucket
+    struct rxinfo_t_* next;
+    int rank_amount;           // amount the entry is ordered by in the relation ranking
+} rxinfo_t;
+
+// Allocate rx entry with an empty tx set
+rxinfo_t* rxinfo_empty() {
+    rxinfo_t* result = slab_alloc(sizeof(rxinfo_t));
+
+    result->name = NULL;
+    idset_init(&result->txs);
+    result->prev = NULL;
+    result->next = NULL;
+    result->rank_amount = 0;
+
+    return result;
+}
+void* v_rxinfo_empty() {
+    return (void*) rxinfo_empty();
+}
+
+// Custom free function
+//  NB. the entry is expected to be unlinked from its bucket already
+void rxinfo_vfree(void* to_free_v) {
+    rxinfo_t* to_free = (rxinfo_t*) to_free_v;
+
+    idset_release(&to_free->txs);
+    slab_free(to_free, sizeof(rxinfo_t));
+}
+
+// Printer for rx entries in maps
+void rxinfo_printer(FILE* out_f, const void* to_print) {
+    idset_printer(out_f, (const void*) &((const rxinfo_t*) to_print)->txs);
+}
+
+// Ranking order of rx entries: most tx entities first, ties broken by name
+int rxinfo_rank_cmp(const void* lhs, const void* rhs) {
+    const rxinfo_t* lhs_rx = (const rxinfo_t*) lhs;
+    const rxinfo_t* rhs_rx = (const rxinfo_t*) rhs;
+
+    if (lhs_rx->rank_amount != rhs_rx->rank_amount)
+        return lhs_rx->rank_amount > rhs_rx->rank_amount ? -1 : 1;
+
+    return handlecmp(lhs_rx->name, rhs_rx->name);
+}
+int rxinfo_rank_qsort_cmp(const void* lhs, const void* rhs) {
+    return rxinfo_rank_cmp(*(const rxinfo_t* const*) lhs, *(const rxinfo_t* const*) rhs);
+}
+
+typedef struct amount_buckets_t_ {
+    rxinfo_t** buckets; // buckets[n] lists the rx entries with n tx entities
+    int cap;
+    int max;            // highest non empty bucket, 0 if there is none
+} amount_buckets_t;
+
+// Initialize empty buckets
+void amounts_init(amount_buckets_t* amounts) {
+    amounts->buckets = NULL;
+    amounts->cap = 0;
+    amounts->max = 0;
+}
+
+// Deallocate bucket storage (rx entries are owned by rxing_ents_map)
+void amounts_destroy(amount_buckets_t* amounts) {
+    free(amounts->buckets);
+    amounts_init(amounts);
+}
+
+// Move rx entry from bucket old_amount to bucket new_amount. Amount 0 stands for no bucket
+void amounts_move(amount_buckets_t* amounts, rxinfo_t* rx, int old_amount, int new_amount) {
+    NULLCHECK2(amounts, rx);
+
+    if (old_amount > 0) {
+        assert(old_amount < amounts->cap);
+
+        if (rx->prev) rx->prev->next = rx->next;
+        else          amounts->buckets[old_amount] = rx->next;
+        if (rx->next) rx->next->prev = rx->prev;
+
+        rx->prev = NULL;
+        rx->next = NULL;
+    }
+
+    if (new_amount > 0) {
+        if (new_amount >= amounts->cap) {
+            int new_cap = amounts->cap ? amounts->cap * 2 : 8;
+            while (new_cap <= new_amount) new_cap *= 2;
+
+            amounts->buckets = realloc(amounts->buckets, sizeof(rxinfo_t*) * new_cap);
+            memset(amounts->buckets + amounts->cap, 0, sizeof(rxinfo_t*) * (new_cap - amounts->cap));
+            amounts->cap = new_cap;
+        }
+
+        rx->next = amounts->buckets[new_amount];
+        if (rx->next) rx->next->prev = rx;
+        amounts->buckets[new_amount] = rx;
+
+        if (new_amount > amounts->max)
+            amounts->max = new_amount;
+    }
+
+    // Max grows by at most one per added tx ent, so scanning down is amortized O(1)
+    while (amounts->max > 0 && !amounts->buckets[amounts->max])
+        amounts->max--;
+}
+
+// Printer for buckets, in the same format used for maps of sets
+void amounts_printer(FILE* out_f, const amount_buckets_t* amounts) {
+    fputs("{ ", out_f);
+    for (int amount = 1; amount <= amounts->max; amount++) {
+        if (!amounts->buckets[amount]) continue;
+
+        fprintf(out_f, "(%d: { ", amount);
+        for (rxinfo_t* rx = amounts->buckets[amount]; rx; rx = rx->next)
+            fprintf(out_f, "%s, ", rx->name);
+        fputs("}) ", out_f);
+    }
+    fputs("}", out_f);
+}
+
+/**********************************************/
+/* Data types used to construct relations map */
+/**********************************************/
+typedef struct relinfo_t_ {
+    bmap_t* rxing_ents_map;          // map of (str: rxinfo_t)
+    amount_buckets_t rxing_amounts; // rx entries bucketed by amount of tx entities
+    outbuf_t report_seg;      // cached report output for this relation
+    int report_dirty;         // 1 if report_seg has to be rendered again
+    map_t* ranking;           // set of rxinfo_t in ranking order, NULL until first queried
+} relinfo_t;
+// Custom free function
+void relinfo_free(void* to_free_v) {
+    relinfo_t* to_free = (relinfo_t*) to_free_v;
+
+    if (to_free->ranking) map_free(to_free->ranking);
+    bmap_free(to_free->rxing_ents_map);
+    amounts_destroy(&(to_free->rxing_amounts));
+    outbuf_destroy(&(to_free->report_seg));
+
+    slab_free(to_free, sizeof(relinfo_t));
+}
+
+// Allocate new empty relinfo
+relinfo_t* relinfo_empty() {
+    relinfo_t* result = slab_alloc(sizeof(relinfo_t));
+
+    result->rxing_ents_map = shard_count
+        ? bmap_empty(1, &handlecmp, &shallow_cloner, &do_nothing, &rxinfo_vfree)
+        : bmap_empty(1, &handlecmp, &handle_cloner, &handle_free, &rxinfo_vfree);
+    amounts_init(&(result->rxing_amounts));
+    outbuf_init(&(result->report_seg));
+    result->report_dirty = 1;
+    result->ranking = NULL;
+
+    return result;
+}
+void* v_relinfo_empty() {
+    return (void*) relinfo_empty();
+}
+
+// 1 if relinfo is empty, 0 otherwise 
+int relinfo_is_empty(const relinfo_t* relinfo) {
+    return relinfo->rxing_ents_map->len == 0;
+}
+
+// Custom printer for relinfo entries in maps
+void relinfo_print(FILE* out_f, const void* v_relinfo) {
+    fputs("ri< ", out_f);
+
+    relinfo_t* relinfo = (relinfo_t*) v_relinfo;
+
+    if (!relinfo) {
+        puts("NULL");
+    } else {
+        bmap_print_with(out_f, relinfo->rxing_ents_map, &str_printer, &rxinfo_printer,
+                PRINT_MODE_DB);
+        fputs(", ", out_f);
+        amounts_printer(out_f, &(relinfo->rxing_amounts));
+    }
+
+    fputs(" >", out_f);
+}
+
+/******************************************/
+/* Helper functions for handling entities */
+/******************************************/
+// Get entity by name, NULL if it doesn't exist
+entity_t* ent_get(strtab_t* /* of entity_t */ entities, const char* name) {
+    return (entity_t*) strtab_get(entities, name, handle_hash(name));
+}
+
+// Add an entity to the database, assigning it an id if it's new
+void ent_add(strtab_t* /* of entity_t */ entities, const char* name) {
+    entity_t* entity = strtab_get_or(entities, name, handle_hash(name), &v_entity_empty);
+
+    // Name reference is owned by the map key
+    if (!entity->name) {
+        entity->name = name;
+    }
+}
+
+// Get incidence of entity in given relation, creating it if needed
+incid_t* ent_incid_get_or(entity_t* entity, const char* rel_id, relinfo_t* relinfo) {
+    incid_t* incid = map_get_or(ent_incidence(entity), (const void*) rel_id, &v_incid_empty);
+
+    if (!incid->relinfo) {
+        incid->relinfo = relinfo;
+    }
+    assert(incid->relinfo == relinfo);
+
+    return incid;
+}
+
+// Drop incidence of entity in given relation if the entity doesn't take part in it anymore
+void ent_incid_cleanup(entity_t* entity, const char* rel_id) {
+    map_t* incidence = ent_incidence(entity);
+    map_node_t* incid_node = node_get(incidence->root, (const void*) rel_id, incidence->comp);
+    incid_t* incid = (incid_t*) NOTNULL(incid_node)->data;
+
+    if (incid->rxs.len == 0 && !incid->is_rx) {
+        map_remove_node(incidence, incid_node);
+    }
+}
+
+/*******************************************/
+/* Helper functions for handling relations */
+/*******************************************/
+// Update rxing_amounts after the amount of tx ents of an rx ent changed.
+//  NB. this is just kept updated for optimization purposes
+void relinfo_update_amount(relinfo_t* relinfo, rxinfo_t* rx, int old_amount, int new_amount) {
+    amount_buckets_t* amounts = &(relinfo->rxing_amounts);
+
+    // Cached report output only depends on the highest bucket
+    if (old_amount == amounts->max || new_amount >= amounts->max) {
+        relinfo->report_dirty = 1;
+    }
+
+    amounts_move(amounts, rx, old_amount, new_amount);
+
+    // Ranking, if any, is kept up to date from the first query on
+    if (relinfo->ranking) {
+        assert(rx->rank_amount == old_amount);
+
+        if (old_amount > 0) map_remove(relinfo->ranking, rx);
+        rx->rank_amount = new_amount;
+        if (new_amount > 0) set_add(relinfo->ranking, rx);
+    }
+}
+
+// Get ranking of the rx entries of a relation, building it if it's the first query.
+//  NB. rx entries with no tx entities are not ranked
+map_t* relinfo_ranking(relinfo_t* relinfo) {
+    if (relinfo->ranking) {
+        return relinfo->ranking;
+    }
+    relinfo->ranking = map_empty(&rxinfo_rank_cmp, &shallow_cloner, &disallow_duplicates,
+                                 &do_nothing, &do_nothing);
+
+    bmap_t* rx_map = relinfo->rxing_ents_map;
+    const void** rxs = malloc(sizeof(const void*) * (rx_map->len + 1));
+    if (!rxs) ERROR("Out of memory for ranking\n");
+
+    int rxs_len = 0;
+    for (bmap_iter_t it = bmap_iter(rx_map); bmap_iter_next(&it);) {
+        rxinfo_t* rx = (rxinfo_t*) it.data;
+
+        rx->rank_amount = rx->txs.len;
+        if (rx->rank_amount > 0) rxs[rxs_len++] = rx;
+    }
+    qsort(rxs, rxs_len, sizeof(const void*), &rxinfo_rank_qsort_cmp);
+    map_fill_sorted(relinfo->ranking, rxs, (void**) rxs, rxs_len);
+
+    free(rxs);
+    return relinfo->ranking;
+}
+
+// Get the rx entry of an entity in a relation, creating it if needed
+rxinfo_t* relinfo_rx_get_or(relinfo_t* relinfo, const char* rxing_ent) {
+    // Map layout: rx_map = {rxing_ent, rx = {txs = {txing_ent id}}}
+    bmap_t* rx_map = NOTNULL(relinfo->rxing_ents_map);
+    rxinfo_t* rx = (rxinfo_t*) bmap_get_or(rx_map, rxing_ent, &v_rxinfo_empty);
+
+    // Name reference is owned by the map key (cloning a handle gives the handle itself)
+    if (!rx->name) {
+        rx->name = rxing_ent;
+    }
+
+    return rx;
+}
+
+// Add edge from tx entity to the rx entity of a given rx entry
+void relinfo_edge_add(relinfo_t* relinfo, const char* rel_id, rxinfo_t* rx,
+                      entity_t* tx_entity, entity_t* rx_entity) {
+    if (idset_add(&rx->txs, tx_entity->id) == MAP_OK) {
+        // Since this function can't fail to add a new relation, the amount of
+        // tx ents that the rx ent of this relation must have increased
+        relinfo_update_amount(relinfo, rx, rx->txs.len - 1, rx->txs.len);
+
+        // Keep incidence index up to date
+        idset_add(&ent_incid_get_or(tx_entity, rel_id, relinfo)->rxs, rx_entity->id);
+        ent_incid_get_or(rx_entity, rel_id, relinfo)->is_rx = 1;
+    }
+}
+
+// Remove edge from tx entity to the rx entity of a given rx entry. The rx entry is
+// kept even if its tx set is emptied (see relinfo_rx_cleanup)
+void relinfo_edge_del(relinfo_t* relinfo, const char* rel_id, rxinfo_t* rx,
+                      entity_t* tx_entity, entity_t* rx_entity) {
+    if (idset_remove(&rx->txs, tx_entity->id) != MAP_OK) {
+        return;
+    }
+    int txs_len = rx->txs.len;
+
+    // Update tx_ammount cache
+    relinfo_update_amount(relinfo, rx, txs_len + 1, txs_len);
+
+    // Update incidence index
+    idset_remove(&ent_incid_get_or(tx_entity, rel_id, relinfo)->rxs, rx_entity->id);
+    ent_incid_cleanup(tx_entity, rel_id);
+}
+
+// Completely remove rx entry if its tx set is emptied
+void relinfo_rx_cleanup(relinfo_t* relinfo, const char* rel_id, rxinfo_t* rx, entity_t* rx_entity) {
+    if (rx->txs.len == 0) {
+        bmap_remove(relinfo->rxing_ents_map, rx_entity->name);
+
+        ent_incid_get_or(rx_entity, rel_id, relinfo)->is_rx = 0;
+        ent_incid_cleanup(rx_entity, rel_id);
+    }
+}
+
+// Add a relation to the database
+//  NB. all ids are expected to be interned handles
+void rel_add_entities(bmap_t* /* of relinfo_t */ relations,
+                      entity_t* tx_entity, entity_t* rx_entity, const char* rel_id) {
+    relinfo_t* relinfo = bmap_get_or(relations, rel_id, &v_relinfo_empty);
+
+    // Associate rx_ent to tx_ent in rxing_ents_map.
+    rxinfo_t* rx = relinfo_rx_get_or(relinfo, rx_entity->name);
+    relinfo_edge_add(relinfo, rel_id, rx, tx_entity, rx_entity);
+}
+void rel_add(strtab_t* /* of entity_t */ entities, bmap_t* /* of relinfo_t */ relations,
+             const char* txing_ent, const char* rxing_ent, const char* rel_id) {
+    entity_t* tx_entity = ent_get(entities, txing_ent);
+    entity_t* rx_entity = ent_get(entities, rxing_ent);
+    if (!tx_entity || !rx_entity) {
+        STATS_INC(rel_dropped[1]);
+        return;
+    }
+
+    rel_add_entities(relations, tx_entity, rx_entity, rel_id);
+}
+
+// Deletes relation from database
+void rel_del_entities(bmap_t* /* of relinfo_t */ relations,
+                      entity_t* tx_entity, entity_t* rx_entity, const char* rel_id);
+void rel_del(strtab_t* /* of entity_t */ entities, bmap_t* /* of relinfo_t */ relations,
+             const char* txing_ent, const char* rxing_ent, const char* rel_id) {
+    // A relation can't involve an entity which doesn't exist
+    entity_t* tx_entity = ent_get(entities, txing_ent);
+    entity_t* rx_entity = ent_get(entities, rxing_ent);
+    if (!tx_entity || !rx_entity) {
+        STATS_INC(rel_dropped[0]);
+        return;
+    }
+
+    rel_del_entities(relations, tx_entity, rx_entity, rel_id);
+}
+void rel_del_entities(bmap_t* /* of relinfo_t */ relations,
+                      entity_t* tx_entity, entity_t* rx_entity, const char* rel_id) {
+    // Get relinfo relative to removed relation
+    relinfo_t* relinfo = (relinfo_t*) bmap_get(relations, rel_id);
+
+    // Exit if relation to remove doesn't exist
+    if (!relinfo) {
+        return;
+    }
+
+    // Remove rxing_ent and txing_ent
+    rxinfo_t* rx = (rxinfo_t*) bmap_get(relinfo->rxing_ents_map, rx_entity->name);
+    if (!rx) {
+        return;
+    }
+
+    relinfo_edge_del(relinfo, rel_id, rx, tx_entity, rx_entity);
+    relinfo_rx_cleanup(relinfo, rel_id, rx, rx_entity);
+
+    // Cleanup relinfo if empty
+    if (relinfo_is_empty(relinfo))  {
+        bmap_remove(relations, rel_id);
+    }
+}
+
+// Delete an entity and all of its relations. Only the relations the entity takes
+// part in (as found in its incidence index) are visited.
+void ent_del_update_relinfo(bmap_t* relations, const char* rel_id, incid_t* incid, entity_t* to_remove);
+void ent_del_relations(bmap_t* /* of relinfo */ relations, entity_t* entity) {
+    // The incidence index of the removed entity itself is left untouched until it's freed
+    for (map_iter_t it = map_iter(ent_incidence(entity)); map_iter_next(&it);) {
+        ent_del_update_relinfo(relations, it.cur->key, (incid_t*) it.cur->data, entity);
+    }
+}
+void ent_del(strtab_t* /* of entity_t */ entities, bmap_t* /* of relinfo */ relations, const char* to_remove) {
+    strtab_slot_t* entity_slot = strtab_lookup(entities, to_remove, handle_hash(to_remove));
+
+    if (entity_slot) {
+        ent_del_relations(relations, (entity_t*) entity_slot->data);
+
+        // Entity id can only be recycled once it's gone from every tx set
+        strtab_remove_slot(entities, entity_slot);
+    }
+}
+// Helper function removing entity from a single relinfo
+void ent_del_update_relinfo(bmap_t* relations, const char* rel_id, incid_t* incid, entity_t* to_remove) {
+    NULLCHECK3(rel_id, incid, to_remove);
+
+    relinfo_t* relinfo = incid->relinfo;
+    bmap_t* rxs_map = relinfo->rxing_ents_map;
+
+    // Remove entity from the tx set of every rx ent it's related to
+    int rxs_len = incid->rxs.len;
+    int* rx_ids = idset_members(&incid->rxs);
+    for (int i = 0; i < rxs_len; i++) {
+        entity_t* rx_entity = entity_of_id(rx_ids[i]);
+        rxinfo_t* rx = (rxinfo_t*) NOTNULL(bmap_get(rxs_map, rx_entity->name));
+
+        int removal_res = idset_remove(&rx->txs, to_remove->id);
+        assert(removal_res == MAP_OK);
+        (void) removal_res;
+
+        relinfo_update_amount(relinfo, rx, rx->txs.len + 1, rx->txs.len);
+
+        // Deallocate rx entry associated with empty tx set
+        if (rx->txs.len == 0) {
+            bmap_remove(rxs_map, rx_entity->name);
+
+            if (rx_entity != to_remove) {
+                ent_incid_get_or(rx_entity, rel_id, relinfo)->is_rx = 0;
+                ent_incid_cleanup(rx_entity, rel_id);
+            }
+        }
+    }
+    free(rx_ids);
+
+    // Remove the entity from the receiving end too
+    rxinfo_t* rx = incid->is_rx ? (rxinfo_t*) bmap_get(rxs_map, to_remove->name) : NULL;
+    if (rx) {
+        int txs_len = rx->txs.len;
+        int* tx_ids = idset_members(&rx->txs);
+
+        for (int i = 0; i < txs_len; i++) {
+            entity_t* tx_entity = entity_of_id(tx_ids[i]);
+
+            if (tx_entity != to_remove) {
+                idset_remove(&ent_incid_get_or(tx_entity, rel_id, relinfo)->rxs, to_remove->id);
+                ent_incid_cleanup(tx_entity, rel_id);
+            }
+        }
+        free(tx_ids);
+
+        // Update amm cache with regard to the removed rx entity
+        relinfo_update_amount(relinfo, rx, txs_len, 0);
+
+        bmap_remove(rxs_map, to_remove->name);
+    }
+
+    // Update could have left relinfo empty and in need of deallocation
+    if (relinfo_is_empty(relinfo)) {
+        int removal_res = bmap_remove(relations, (const void*) rel_id);
+        assert(removal_res == MAP_OK);
+        (void) removal_res;
+    }
+}
+
+
+/*******************************************************************************/
+/* Lazy entity deletion. With the lazy option a delent only moves the entity   */
+/* from the entities table to the queue of dead ones, and its edges are purged */
+/* a few at a time along with the commands that follow, in deletion order.     */
+/* Whatever looks at relations (report, rank, debug output, snapshots) purges  */
+/* every pending edge first, so the output is the one of eager deletion. Ids   */
+/* of dead entities are only recycled once purged, so the stale ids left in tx */
+/* sets keep pointing to them in the meantime.                                 */
+/*******************************************************************************/
+#define PURGE_STEP_EDGES 64 // edges purged along with every command
+
+// Steps in purging the dead entity at the head of the queue
+#define PURGE_START 0       // start going through the relations of the entity
+#define PURGE_NEXT_REL 1    // move to the next relation of the entity
+#define PURGE_TX 2          // remove the entity from tx sets of the rx ents it's related to
+#define PURGE_RX 3          // remove the entity from incidences of its tx ents
+
+typedef struct ent_purger_t_ {
+    entity_t** queue;       // dead entities, in order of deletion
+    int head;               // first one still to be purged
+    int len;
+    int cap;
+    strtab_t* names;        // (name: entity_t) of the dead entities, holding their names
+    map_iter_t incid_it;    // relation of the head entity being purged
+    int step;
+    int* ids;               // members left when the current step began
+    int ids_len;
+    int ids_pos;            // first member still to be processed
+} ent_purger_t;
+
+// Purger of the running program, NULL unless deletion is lazy
+ent_purger_t* purger = NULL;
+
+ent_purger_t* ent_purger_new() {
+    ent_purger_t* result = calloc(1, sizeof(ent_purger_t));
+    if (!result) ERROR("Out of memory for purger\n");
+
+    result->names = strtab_empty(&handle_cloner, &handle_free, &do_nothing);
+    result->step = PURGE_START;
+
+    return result;
+}
+
+// Mark entity as dead, leaving its edges in place. O(1) amortized
+void ent_del_lazy(ent_purger_t* purger, strtab_t* /* of entity_t */ entities, const char* to_remove) {
+    uint32_t hash = handle_hash(to_remove);
+    strtab_slot_t* entity_slot = strtab_lookup(entities, to_remove, hash);
+
+    if (!entity_slot) {
+        return;
+    }
+
+    // Dead entity names are kept by the purger instead
+    int add_res = strtab_add(purger->names, to_remove, hash, entity_slot->data);
+    assert(add_res == MAP_OK);
+    (void) add_res;
+    entity_t* entity = (entity_t*) strtab_take_slot(entities, entity_slot);
+
+    if (purger->len == purger->cap) {
+        if (purger->head > 0) {
+            memmove(purger->queue, purger->queue + purger->head,
+                    sizeof(entity_t*) * (purger->len - purger->head));
+            purger->len -= purger->head;
+            purger->head = 0;
+        } else {
+            purger->cap = purger->cap ? purger->cap * 2 : 64;
+            purger->queue = realloc(purger->queue, sizeof(entity_t*) * purger->cap);
+            if (!purger->queue) ERROR("Out of memory for purger\n");
+        }
+    }
+    purger->queue[purger->len++] = entity;
+}
+
+// 1 if some dead entity still has to be purged
+int ent_purge_pending(const ent_purger_t* purger) {
+    return purger && purger->head < purger->len;
+}
+
+// Take a snapshot of the members of an id set to go through in the current step
+void ent_purge_snapshot(ent_purger_t* purger, const idset_t* ids) {
+    free(purger->ids);
+    purger->ids = idset_members(ids);
+    purger->ids_len = ids->len;
+    purger->ids_pos = 0;
+}
+
+// Purge edges of dead entities, about budget of them (also counting relations).
+// The same work as ent_del_update_relinfo, split into steps which may stop anywhere:
+// nothing but the purger touches the edges and the incidence of the head entity
+void ent_purge(ent_purger_t* purger, bmap_t* /* of relinfo_t */ relations, int budget) {
+    while (ent_purge_pending(purger) && budget > 0) {
+        entity_t* entity = purger->queue[purger->head];
+        map_iter_t* incid_it = &(purger->incid_it);
+
+        if (purger->step == PURGE_START) {
+            *incid_it = map_iter(ent_incidence(entity));
+            purger->step = PURGE_NEXT_REL;
+        }
+
+        if (purger->step == PURGE_NEXT_REL) {
+            if (!map_iter_next(incid_it)) {
+                // Every edge is gone, the entity itself is freed along with its id
+                const char* name = entity->name;
+                entity_free(entity);
+                strtab_remove(purger->names, name, handle_hash(name));
+
+                if (++(purger->head) == purger->len) {
+                    purger->head = purger->len = 0;
+                }
+                purger->step = PURGE_START;
+                continue;
+            }
+
+            ent_purge_snapshot(purger, &((incid_t*) incid_it->cur->data)->rxs);
+            purger->step = PURGE_TX;
+            budget--;
+        }
+
+        const char* rel_id = incid_it->cur->key;
+        incid_t* incid = (incid_t*) incid_it->cur->data;
+        relinfo_t* relinfo = incid->relinfo;
+        bmap_t* rxs_map = relinfo->rxing_ents_map;
+        rxinfo_t* own_rx = incid->is_rx ? (rxinfo_t*) bmap_get(rxs_map, entity->name) : NULL;
+
+        if (purger->step == PURGE_TX) {
+            for (; purger->ids_pos < purger->ids_len && budget > 0; purger->ids_pos++, budget--) {
+                entity_t* rx_entity = entity_of_id(purger->ids[purger->ids_pos]);
+                rxinfo_t* rx = (rxinfo_t*) NOTNULL(bmap_get(rxs_map, rx_entity->name));
+
+                int removal_res = idset_remove(&rx->txs, entity->id);
+                assert(removal_res == MAP_OK);
+                (void) removal_res;
+
+                relinfo_update_amount(relinfo, rx, rx->txs.len + 1, rx->txs.len);
+
+                if (rx->txs.len == 0) {
+                    bmap_remove(rxs_map, rx_entity->name);
+
+                    if (rx_entity != entity) {
+                        ent_incid_get_or(rx_entity, rel_id, relinfo)->is_rx = 0;
+                        ent_incid_cleanup(rx_entity, rel_id);
+                    } else {
+                        own_rx = NULL;
+                    }
+                }
+            }
+            if (purger->ids_pos < purger->ids_len) {
+                break;
+            }
+
+            if (own_rx) ent_purge_snapshot(purger, &own_rx->txs);
+            else        purger->ids_len = purger->ids_pos = 0;
+            purger->step = PURGE_RX;
+        }
+
+        // Rx entry of the entity is left as it is until every tx ent is done with it
+        for (; purger->ids_pos < purger->ids_len && budget > 0; purger->ids_pos++, budget--) {
+            entity_t* tx_entity = entity_of_id(purger->ids[purger->ids_pos]);
+
+            if (tx_entity != entity) {
+                idset_remove(&ent_incid_get_or(tx_entity, rel_id, relinfo)->rxs, entity->id);
+                ent_incid_cleanup(tx_entity, rel_id);
+            }
+        }
+        if (purger->ids_pos < purger->ids_len) {
+            break;
+        }
+
+        if (own_rx) {
+            relinfo_update_amount(relinfo, own_rx, own_rx->txs.len, 0);
+            bmap_remove(rxs_map, entity->name);
+        }
+        if (relinfo_is_empty(relinfo)) {
+            int removal_res = bmap_remove(relations, (const void*) rel_id);
+            assert(removal_res == MAP_OK);
+            (void) removal_res;
+        }
+        purger->step = PURGE_NEXT_REL;
+    }
+}
+
+// Purge every pending edge
+void ent_purge_all(ent_purger_t* purger, bmap_t* /* of relinfo_t */ relations) {
+    ent_purge(purger, relations, INT_MAX);
+}
+
+// Purge entities up to the dead one with the given name, if any, so that the name
+// can be taken by a new entity
+void ent_purge_name(ent_purger_t* purger, bmap_t* /* of relinfo_t */ relations, const char* name) {
+    while (ent_purge_pending(purger) && strtab_get(purger->names, name, handle_hash(name))) {
+        ent_purge(purger, relations, PURGE_STEP_EDGES);
+    }
+}
+
+// Free purger, along with the dead entities it still holds (their edges go with relations)
+void ent_purger_free(ent_purger_t* purger) {
+    if (!purger) {
+        return;
+    }
+
+    for (int i = purger->head; i < purger->len; i++) {
+        entity_free(purger->queue[i]);
+    }
+
+    strtab_free(purger->names);
+    free(purger->queue);
+    free(purger->ids);
+    free(purger);
+}
+
+
+// TODO: implement this with currying (see above)
+/************************************************************************************/
+/* // Removes relation from database                                                */
+/* void rel_del(map_t* * of relinfo_t *\/ relations,                                */
+/*              const char* txing_ent, const char* rxing_ent, const char* rel_id) { */
+/*     void do_it(map_t* map, const void* key) {                                    */
+/*         rel_del_no_cleanup(map, txing_ent, rxing_ent, (const char*) key);        */
+/*     }                                                                            */
+/*                                                                                  */
+/*     do_then_cleanup(&do_it, &relinfo_is_empty, &relinfo_vfree);                  */
+/* }                                                                                */
+/*                                                                                  */
+/************************************************************************************/
+
+/*****************************************************************************/
+/* Batched relation updates. In batch mode addrel and delrel are buffered    */
+/* until a command needs the relations (report, delent, prel). Entities are  */
+/* resolved when a command is read: they can't go away before the flush as   */
+/* delent flushes first, and addent can't affect the commands already read.  */
+/* Only the last command on every edge matters. The remaining ones are       */
+/* sorted and applied grouped by relation and rx entity, so every relinfo    */
+/* and rx entry is looked up once per batch.                                 */
+/*****************************************************************************/
+typedef struct relop_t_ {
+    const char* rel_id;     // interned handle, the batch holds a reference to it
+    int rel_idx;            // dense index of rel_id within the batch
+    int rx_id;
+    int tx_id;
+    int is_add;
+} relop_t;
+
+typedef struct relbatch_t_ {
+    relop_t* ops;           // in input order until sorted
+    relop_t* scratch;       // sorting buffer, same capacity as ops
+    int len;
+    int cap;
+    strtab_t* rel_idxs;     // (rel_id: rel_idx + 1) for the relations in the batch
+    int max_id;             // highest entity id in the batch
+} relbatch_t;
+
+// Global batch of pending relation updates
+relbatch_t rel_batch = { NULL, NULL, 0, 0, NULL, 0 };
+
+// Buffer addrel (is_add = 1) or delrel (is_add = 0). Commands involving entities which
+// don't exist are dropped straight away
+void relbatch_push(relbatch_t* batch, strtab_t* /* of entity_t */ entities,
+                   const char* txing_ent, const char* rxing_ent, const char* rel_id, int is_add) {
+    entity_t* tx_entity = ent_get(entities, txing_ent);
+    entity_t* rx_entity = ent_get(entities, rxing_ent);
+    if (!tx_entity || !rx_entity) {
+        STATS_INC(rel_dropped[is_add]);
+        return;
+    }
+
+    if (batch->len == batch->cap) {
+        batch->cap = batch->cap ? batch->cap * 2 : 1024;
+        batch->ops = realloc(batch->ops, sizeof(relop_t) * batch->cap);
+        batch->scratch = realloc(batch->scratch, sizeof(relop_t) * batch->cap);
+        if (!batch->ops || !batch->scratch) ERROR("Out of memory for relation batch");
+    }
+    if (!batch->rel_idxs) {
+        batch->rel_idxs = strtab_empty(&shallow_cloner, &do_nothing, &do_nothing);
+    }
+
+    // Relations are numbered in order of appearance, so that they can be sorted on
+    uint32_t rel_hash = handle_hash(rel_id);
+    intptr_t rel_idx = (intptr_t) strtab_get(batch->rel_idxs, rel_id, rel_hash);
+    if (!rel_idx) {
+        rel_idx = batch->rel_idxs->len + 1;
+        strtab_add(batch->rel_idxs, rel_id, rel_hash, (void*) rel_idx);
+    }
+
+    if (tx_entity->id > batch->max_id) batch->max_id = tx_entity->id;
+    if (rx_entity->id > batch->max_id) batch->max_id = rx_entity->id;
+
+    relop_t op = { intern_ref(rel_id), (int) rel_idx - 1, rx_entity->id, tx_entity->id, is_add };
+    batch->ops[batch->len++] = op;
+}
+
+// Get an int field of an op from its offset
+#define RELOP_FIELD(op, field_offset) (*(const int*) ((const char*) (op) + (field_offset)))
+
+// Stable sort of the batch on an int field ranging over [0, max_value], one byte at a
+// time (LSD radix sort). Ops can't be sorted with qsort at a reasonable cost
+void relbatch_sort_on(relbatch_t* batch, size_t field_offset, int max_value) {
+    for (int shift = 0; shift < 32 && (max_value >> shift) != 0; shift += 8) {
+        int starts[257] = { 0 };
+
+        for (int i = 0; i < batch->len; i++)
+            starts[((RELOP_FIELD(&(batch->ops[i]), field_offset) >> shift) & 0xff) + 1]++;
+        for (int b = 1; b < 257; b++)
+            starts[b] += starts[b - 1];
+        for (int i = 0; i < batch->len; i++) {
+            int b = (RELOP_FIELD(&(batch->ops[i]), field_offset) >> shift) & 0xff;
+            batch->scratch[starts[b]++] = batch->ops[i];
+        }
+
+        relop_t* sorted = batch->scratch;
+        batch->scratch = batch->ops;
+        batch->ops = sorted;
+    }
+}
+
+// Sort ops by relation, rx entity, tx entity and then input order
+void relbatch_sort(relbatch_t* batch) {
+    relbatch_sort_on(batch, offsetof(relop_t, tx_id), batch->max_id);
+    relbatch_sort_on(batch, offsetof(relop_t, rx_id), batch->max_id);
+    relbatch_sort_on(batch, offsetof(relop_t, rel_idx), batch->rel_idxs->len - 1);
+}
+
+// Apply ops on distinct edges of a single relation, sorted by rx entity
+void relbatch_apply_rel(bmap_t* /* of relinfo_t */ relations, const relop_t* ops, int len) {
+    const char* rel_id = ops[0].rel_id;
+
+    int has_add = 0;
+    for (int i = 0; i < len; i++) has_add |= ops[i].is_add;
+
+    // Deletions alone never need a relinfo to be created
+    relinfo_t* relinfo = has_add
+        ? (relinfo_t*) bmap_get_or(relations, rel_id, &v_relinfo_empty)
+        : (relinfo_t*) bmap_get(relations, rel_id);
+    if (!relinfo) {
+        return;
+    }
+
+    bmap_t* rx_map = relinfo->rxing_ents_map;
+
+    for (int i = 0; i < len;) {
+        entity_t* rx_entity = entity_of_id(ops[i].rx_id);
+
+        int rx_end = i;
+        int rx_has_add = 0;
+        while (rx_end < len && ops[rx_end].rx_id == ops[i].rx_id) {
+            rx_has_add |= ops[rx_end++].is_add;
+        }
+
+        rxinfo_t* rx = rx_has_add
+            ? relinfo_rx_get_or(relinfo, rx_entity->name)
+            : (rxinfo_t*) bmap_get(rx_map, rx_entity->name);
+
+        if (rx) {
+            // Edges are distinct, so adding first can only spare rx entry churn
+            for (int j = i; j < rx_end; j++)
+                if (ops[j].is_add) relinfo_edge_add(relinfo, rel_id, rx, entity_of_id(ops[j].tx_id), rx_entity);
+            for (int j = i; j < rx_end; j++)
+                if (!ops[j].is_add) relinfo_edge_del(relinfo, rel_id, rx, entity_of_id(ops[j].tx_id), rx_entity);
+
+            relinfo_rx_cleanup(relinfo, rel_id, rx, rx_entity);
+        }
+
+        i = rx_end;
+    }
+
+    // Cleanup relinfo if empty
+    if (relinfo_is_empty(relinfo)) {
+        bmap_remove(relations, rel_id);
+    }
+}
+
+// Apply every buffered op and empty the batch
+void relbatch_flush(relbatch_t* batch, bmap_t* /* of relinfo_t */ relations) {
+    if (batch->len == 0) {
+        return;
+    }
+
+    relbatch_sort(batch);
+
+    // Keep only the last op on every edge
+    int len = 0;
+    for (int i = 0; i < batch->len; i++) {
+        relop_t* op = &(batch->ops[i]);
+        relop_t* last = len > 0 ? &(batch->ops[len - 1]) : NULL;
+
+        if (last && last->rel_idx == op->rel_idx && last->rx_id == op->rx_id &&
+                last->tx_id == op->tx_id) {
+            intern_release(last->rel_id);
+            *last = *op;
+        } else {
+            batch->ops[len++] = *op;
+        }
+    }
+
+    // Apply ops one relation at a time
+    for (int i = 0; i < len;) {
+        int rel_end = i;
+        while (rel_end < len && batch->ops[rel_end].rel_idx == batch->ops[i].rel_idx) {
+            rel_end++;
+        }
+
+        relbatch_apply_rel(relations, batch->ops + i, rel_end - i);
+        i = rel_end;
+    }
+
+    for (int i = 0; i < len; i++) {
+        intern_release(batch->ops[i].rel_id);
+    }
+    batch->len = 0;
+    batch->max_id = 0;
+    strtab_clear(batch->rel_idxs);
+}
+
+// Deallocate batch storage. Pending ops are dropped
+void relbatch_destroy(relbatch_t* batch) {
+    for (int i = 0; i < batch->len; i++) {
+        intern_release(batch->ops[i].rel_id);
+    }
+    free(batch->ops);
+    free(batch->scratch);
+    if (batch->rel_idxs) strtab_free(batch->rel_idxs);
+    *batch = (relbatch_t) { NULL, NULL, 0, 0, NULL, 0 };
+}
+
+/******************/
+/* Report command */
+/******************/
+// Append the pre-rendered quoted form of an interned string (followed by a space)
+void outbuf_put_quoted(outbuf_t* buf, const char* handle) {
+    const intern_entry_t* entry = intern_entry_of(handle);
+    outbuf_put(buf, entry->str + entry->len + 1, entry->len + 3);
+}
+
+// Comparison function for sorting arrays of interned strings by name
+int handle_qsort_cmp(const void* lhs, const void* rhs) {
+    return handlecmp(*(const char* const*) lhs, *(const char* const*) rhs);
+}
+
+// Render report output of a single relation into its cache
+void relinfo_render_report(relinfo_t* relinfo, const char* rel_id) {
+    const amount_buckets_t* amounts = &(relinfo->rxing_amounts);
+    outbuf_t* seg = &(relinfo->report_seg);
+
+    // Empty rx sets are not allowed
+    assert(amounts->max > 0);
+
+    // Buckets are unordered, so top rx ents are sorted by name here
+    int rxs_len = 0;
+    for (rxinfo_t* rx = amounts->buckets[amounts->max]; rx; rx = rx->next)
+        rxs_len++;
+
+    const char** rxs = malloc(sizeof(const char*) * rxs_len);
+    rxs_len = 0;
+    for (rxinfo_t* rx = amounts->buckets[amounts->max]; rx; rx = rx->next)
+        rxs[rxs_len++] = rx->name;
+    qsort(rxs, rxs_len, sizeof(const char*), &handle_qsort_cmp);
+
+    seg->len = 0;
+    outbuf_put_quoted(seg, rel_id);
+    for (int i = 0; i < rxs_len; i++)
+        outbuf_put_quoted(seg, rxs[i]);
+    outbuf_put_int(seg, amounts->max);
+    outbuf_put(seg, "; ", 2);
+
+    free(rxs);
+
+    relinfo->report_dirty = 0;
+    STATS_INC(segs_rendered);
+}
+
+/****************************************************************************/
+/* Report rendering pool. Segments of different relations are independent, */
+/* so when enough of them are dirty they are rendered by a pool of worker  */
+/* threads (the main thread included), each one grabbing the next pending  */
+/* relation. Segments are still concatenated in key order by the caller.   */
+/****************************************************************************/
+// Below this many dirty relations waking the workers up costs more than it saves
+#define RENDER_POOL_MIN_JOBS 16
+
+typedef struct render_job_t_ {
+    relinfo_t* relinfo;
+    const char* rel_id;
+} render_job_t;
+
+typedef struct render_pool_t_ {
+    pthread_t* workers;
+    int workers_len;
+    pthread_mutex_t lock;
+    pthread_cond_t work_cv;     // signaled when a new round of jobs is published
+    pthread_cond_t done_cv;     // signaled when the last worker is done with a round
+    render_job_t* jobs;
+    int jobs_len;
+    int jobs_cap;
+    int next_job;               // next job to take, accessed atomically
+    int round;                  // incremented every time jobs are published
+    int busy;                   // workers which haven't finished the current round
+    int shutdown;
+} render_pool_t;
+
+// Global rendering pool, NULL when rendering serially
+render_pool_t* render_pool = NULL;
+
+// Render jobs of the current round until none is left
+void render_pool_drain(render_pool_t* pool) {
+    int job;
+    while ((job = __atomic_fetch_add(&(pool->next_job), 1, __ATOMIC_RELAXED)) < pool->jobs_len) {
+        relinfo_render_report(pool->jobs[job].relinfo, pool->jobs[job].rel_id);
+    }
+}
+
+// Worker thread body
+void* render_pool_worker(void* pool_v) {
+    render_pool_t* pool = (render_pool_t*) pool_v;
+    int seen_round = 0;
+
+    pthread_mutex_lock(&(pool->lock));
+    for (;;) {
+        while (!pool->shutdown && pool->round == seen_round)
+            pthread_cond_wait(&(pool->work_cv), &(pool->lock));
+        if (pool->shutdown)
+            break;
+        seen_round = pool->round;
+        pthread_mutex_unlock(&(pool->lock));
+
+        render_pool_drain(pool);
+
+        pthread_mutex_lock(&(pool->lock));
+        if (--pool->busy == 0)
+            pthread_cond_signal(&(pool->done_cv));
+    }
+    pthread_mutex_unlock(&(pool->lock));
+
+    return NULL;
+}
+
+// Start pool rendering with given amount of threads (the calling one included)
+render_pool_t* render_pool_new(int threads) {
+    assert(threads > 1);
+
+    render_pool_t* pool = calloc(1, sizeof(render_pool_t));
+    if (!pool) ERROR("Out of memory for render pool");
+
+    pthread_mutex_init(&(pool->lock), NULL);
+    pthread_cond_init(&(pool->work_cv), NULL);
+    pthread_cond_init(&(pool->done_cv), NULL);
+
+    pool->workers_len = threads - 1;
+    pool->workers = malloc(sizeof(pthread_t) * pool->workers_len);
+    if (!pool->workers) ERROR("Out of memory for render pool");
+    for (int i = 0; i < pool->workers_len; i++) {
+        if (pthread_create(&(pool->workers[i]), NULL, &render_pool_worker, pool) != 0)
+            ERROR("Could not start render thread");
+    }
+
+    return pool;
+}
+
+// Stop worker threads and deallocate pool
+void render_pool_free(render_pool_t* pool) {
+    if (!pool) return;
+
+    pthread_mutex_lock(&(pool->lock));
+    pool->shutdown = 1;
+    pthread_cond_broadcast(&(pool->work_cv));
+    pthread_mutex_unlock(&(pool->lock));
+
+    for (int i = 0; i < pool->workers_len; i++)
+        pthread_join(pool->workers[i], NULL);
+
+    pthread_mutex_destroy(&(pool->lock));
+    pthread_cond_destroy(&(pool->work_cv));
+    pthread_cond_destroy(&(pool->done_cv));
+    free(pool->workers);
+    free(pool->jobs);
+    free(pool);
+}
+
+// Queue a relation for the next call to render_pool_run
+void render_pool_push(render_pool_t* pool, relinfo_t* relinfo, const char* rel_id) {
+    if (pool->jobs_len == pool->jobs_cap) {
+        pool->jobs_cap = pool->jobs_cap ? pool->jobs_cap * 2 : 64;
+        pool->jobs = realloc(pool->jobs, sizeof(render_job_t) * pool->jobs_cap);
+        if (!pool->jobs) ERROR("Out of memory for render pool");
+    }
+
+    pool->jobs[pool->jobs_len++] = (render_job_t) { relinfo, rel_id };
+}
+
+// Render every queued relation and wait until all of them are done
+void render_pool_run(render_pool_t* pool) {
+    if (pool->jobs_len < RENDER_POOL_MIN_JOBS) {
+        for (int i = 0; i < pool->jobs_len; i++)
+            relinfo_render_report(pool->jobs[i].relinfo, pool->jobs[i].rel_id);
+    } else {
+        pthread_mutex_lock(&(pool->lock));
+        pool->next_job = 0;
+        pool->busy = pool->workers_len;
+        pool->round++;
+        pthread_cond_broadcast(&(pool->work_cv));
+        pthread_mutex_unlock(&(pool->lock));
+
+        render_pool_drain(pool);
+
+        pthread_mutex_lock(&(pool->lock));
+        while (pool->busy > 0)
+            pthread_cond_wait(&(pool->done_cv), &(pool->lock));
+        pthread_mutex_unlock(&(pool->lock));
+    }
+
+    pool->jobs_len = 0;
+}
+
+// Buffer holding the whole output of a report
+outbuf_t report_buf = { NULL, 0, 0 };
+
+// Print report, only rendering again the relations that changed since last time
+void report(FILE* out_f, const bmap_t* /* of relinfo_t */ relations) {
+    report_buf.len = 0;
+
+    if (relations->len == 0) {
+        outbuf_put(&report_buf, "none\n", 5);
+    } else  {
+        // Dirty segments are rendered all at once by the pool, if there's one
+        if (render_pool) {
+            for (bmap_iter_t it = bmap_iter(relations); bmap_iter_next(&it);) {
+                relinfo_t* relinfo = (relinfo_t*) it.data;
+                if (relinfo->report_dirty) {
+                    render_pool_push(render_pool, relinfo, it.key);
+                }
+            }
+            render_pool_run(render_pool);
+        }
+
+        for (bmap_iter_t it = bmap_iter(relations); bmap_iter_next(&it);) {
+            relinfo_t* relinfo = (relinfo_t*) it.data;
+
+            if (relinfo->report_dirty) {
+                relinfo_render_report(relinfo, it.key);
+            }
+
+            outbuf_put(&report_buf, relinfo->report_seg.data, relinfo->report_seg.len);
+        }
+        STATS_ADD(segs_reported, relations->len);
+        outbuf_putc(&report_buf, '\n');
+    }
+
+    output_write(&report_buf, out_f);
+}
+
+/****************************************************************************/
+/* Ranking queries. Rx entries of a relation are ranked by their amount of  */
+/* tx entities (ties broken by name) in an order statistic tree, so the top */
+/* k of a relation cost O(k + log n) and the rank of an entry O(log n).     */
+/****************************************************************************/
+// Print the top k rx ents of every relation, as "rel" "rx" amount "rx" amount ...;
+// Relations may be split among many maps, whose keys are merged in order
+void report_top(FILE* out_f, bmap_t** /* of relinfo_t */ relations, int relations_len, int k) {
+    report_buf.len = 0;
+
+    bmap_iter_t* iters = malloc(sizeof(bmap_iter_t) * relations_len);
+    if (!iters) ERROR("Out of memory for report\n");
+
+    int live_rels = 0;
+    for (int i = 0; i < relations_len; i++) {
+        iters[i] = bmap_iter(relations[i]);
+        bmap_iter_next(&(iters[i]));
+        live_rels += relations[i]->len;
+    }
+
+    if (live_rels == 0) {
+        outbuf_put(&report_buf, "none\n", 5);
+    } else {
+        for (;;) {
+            bmap_iter_t* min_it = NULL;
+            for (int i = 0; i < relations_len; i++) {
+                bmap_iter_t* it = &(iters[i]);
+                if (it->leaf && (!min_it || handlecmp(it->key, min_it->key) < 0))
+                    min_it = it;
+            }
+            if (!min_it) break;
+
+            map_t* ranking = relinfo_ranking((relinfo_t*) min_it->data);
+
+            outbuf_put_quoted(&report_buf, min_it->key);
+            map_node_t* node = map_select(ranking, 0);
+            for (int i = 0; i < k && node; i++, node = node_next(node)) {
+                const rxinfo_t* rx = (const rxinfo_t*) node->key;
+
+                if (i > 0) outbuf_putc(&report_buf, ' ');
+                outbuf_put_quoted(&report_buf, rx->name);
+                outbuf_put_int(&report_buf, rx->rank_amount);
+            }
+            outbuf_put(&report_buf, "; ", 2);
+
+            bmap_iter_next(min_it);
+        }
+        outbuf_putc(&report_buf, '\n');
+    }
+
+    output_write(&report_buf, out_f);
+    free(iters);
+}
+
+// Print the position of an entity among the rx ents of a relation (counting from 1)
+// along with its amount of tx entities, or none if it doesn't receive in the relation
+//  NB. ids are expected to be interned handles
+void report_rank(FILE* out_f, bmap_t* /* of relinfo_t */ relations,
+                 const char* rxing_ent, const char* rel_id) {
+    relinfo_t* relinfo = relations ? (relinfo_t*) bmap_get(relations, rel_id) : NULL;
+    rxinfo_t* rx = relinfo ? (rxinfo_t*) bmap_get(relinfo->rxing_ents_map, rxing_ent) : NULL;
+
+    report_buf.len = 0;
+
+    if (!rx || rx->txs.len == 0) {
+        outbuf_put(&report_buf, "none\n", 5);
+    } else {
+        map_t* ranking = relinfo_ranking(relinfo);
+
+        outbuf_put_int(&report_buf, map_rank(ranking, rx) + 1);
+        outbuf_putc(&report_buf, ' ');
+        outbuf_put_int(&report_buf, rx->rank_amount);
+        outbuf_putc(&report_buf, '\n');
+    }
+
+    output_write(&report_buf, out_f);
+}
+
+/******************************************************************************/
+/* Sharded engine. Relations are partitioned by rel id among shards, each one */
+/* owned by a worker thread and fed by the main thread (which parses input    */
+/* and owns the entities) through a lock-free single producer, single         */
+/* consumer queue. delent is broadcast to every shard, and both delent and    */
+/* report wait for every shard to catch up before going on.                   */
+/* Shards never touch intern refcounts: rel ids stay interned as long as they */
+/* are in engine_t rels, entity names as long as their entity exists.         */
+/******************************************************************************/
+#define SHARD_QUEUE_CAP (1 << 14)   // must be a power of two
+#define SHARD_SPINS 1024            // empty queue polls before going to sleep
+#define CACHE_LINE 64
+
+enum { SHARD_OP_ADDREL, SHARD_OP_DELREL, SHARD_OP_DELENT, SHARD_OP_REPORT, SHARD_OP_SYNC, SHARD_OP_STOP };
+
+typedef struct shard_op_t_ {
+    int type;
+    const char* rel_id;
+    entity_t* tx_entity;    // the removed entity for SHARD_OP_DELENT
+    entity_t* rx_entity;
+} shard_op_t;
+
+struct engine_t_;
+typedef struct shard_t_ {
+    // Consumer side
+    size_t head;            // next op to read
+    int sleeping;           // 1 while waiting for wake_cv
+    char pad0[CACHE_LINE];
+    // Producer side
+    size_t tail;            // next op to write
+    char pad1[CACHE_LINE];
+
+    shard_op_t* ops;
+    pthread_mutex_t lock;
+    pthread_cond_t wake_cv;
+    bmap_t* relations;       // map of (rel id: relinfo_t) of the shard
+    int idx;
+    struct engine_t_* engine;
+    pthread_t thread;
+} shard_t;
+
+typedef struct engine_t_ {
+    shard_t** shards;
+    int shards_len;
+    strtab_t* rels;         // (rel id: shard_t), every relation which may have edges
+    pthread_mutex_t lock;
+    pthread_cond_t done_cv; // signaled when the last shard reaches a barrier
+    int pending;            // shards which haven't reached the current barrier
+    bmap_iter_t* iters;     // report merging storage, one iterator per shard
+} engine_t;
+
+// Queue an op (main thread only)
+void shard_push(shard_t* shard, shard_op_t op) {
+    size_t tail = shard->tail;
+    while (tail - __atomic_load_n(&(shard->head), __ATOMIC_ACQUIRE) == SHARD_QUEUE_CAP)
+        sched_yield();
+
+    shard->ops[tail & (SHARD_QUEUE_CAP - 1)] = op;
+
+    // Sequentially consistent, as the accesses in shard_pop: either the shard sees
+    // the op before sleeping, or we see it asleep
+    __atomic_store_n(&(shard->tail), tail + 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&(shard->sleeping), __ATOMIC_SEQ_CST)) {
+        pthread_mutex_lock(&(shard->lock));
+        pthread_cond_signal(&(shard->wake_cv));
+        pthread_mutex_unlock(&(shard->lock));
+    }
+}
+
+// Dequeue next op, waiting for it if needed (shard thread only)
+shard_op_t shard_pop(shard_t* shard) {
+    size_t head = shard->head;
+
+    for (int spins = 0; __atomic_load_n(&(shard->tail), __ATOMIC_ACQUIRE) == head; spins++) {
+        if (spins < SHARD_SPINS)
+            continue;
+
+        pthread_mutex_lock(&(shard->lock));
+        __atomic_store_n(&(shard->sleeping), 1, __ATOMIC_SEQ_CST);
+        while (__atomic_load_n(&(shard->tail), __ATOMIC_SEQ_CST) == head)
+            pthread_cond_wait(&(shard->wake_cv), &(shard->lock));
+        __atomic_store_n(&(shard->sleeping), 0, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&(shard->lock));
+    }
+
+    shard_op_t op = shard->ops[head & (SHARD_QUEUE_CAP - 1)];
+    __atomic_store_n(&(shard->head), head + 1, __ATOMIC_RELEASE);
+    return op;
+}
+
+// Tell the main thread a shard reached the current barrier
+void engine_barrier_reached(engine_t* engine) {
+    pthread_mutex_lock(&(engine->lock));
+    if (--engine->pending == 0)
+        pthread_cond_signal(&(engine->done_cv));
+    pthread_mutex_unlock(&(engine->lock));
+}
+
+// Shard thread body
+void* shard_worker(void* shard_v) {
+    shard_t* shard = (shard_t*) shard_v;
+    shard_self = shard->idx;
+
+    for (;;) {
+        shard_op_t op = shard_pop(shard);
+
+        switch (op.type) {
+            case SHARD_OP_ADDREL:
+                rel_add_entities(shard->relations, op.tx_entity, op.rx_entity, op.rel_id);
+                break;
+
+            case SHARD_OP_DELREL:
+                rel_del_entities(shard->relations, op.tx_entity, op.rx_entity, op.rel_id);
+                break;
+
+            case SHARD_OP_DELENT:
+                ent_del_relations(shard->relations, op.tx_entity);
+                engine_barrier_reached(shard->engine);
+                break;
+
+            case SHARD_OP_REPORT:
+                // Segments are rendered here, the main thread only merges them
+                for (bmap_iter_t it = bmap_iter(shard->relations); bmap_iter_next(&it);) {
+                    relinfo_t* relinfo = (relinfo_t*) it.data;
+                    if (relinfo->report_dirty) {
+                        relinfo_render_report(relinfo, it.key);
+                    }
+                }
+                engine_barrier_reached(shard->engine);
+                break;
+
+            case SHARD_OP_SYNC:
+                engine_barrier_reached(shard->engine);
+                break;
+
+            case SHARD_OP_STOP:
+                slab_retire();
+                return NULL;
+        }
+    }
+}
+
+// Start engine with given amount of shards. Must be called before any entity exists
+engine_t* engine_new(int shards_len) {
+    assert(shards_len > 0 && ent_registry.next_id == 0);
+
+    shard_count = shards_len;
+
+    engine_t* engine = calloc(1, sizeof(engine_t));
+    if (!engine) ERROR("Out of memory for engine");
+
+    engine->shards_len = shards_len;
+    engine->shards = calloc(shards_len, sizeof(shard_t*));
+    engine->iters = calloc(shards_len, sizeof(bmap_iter_t));
+    engine->rels = strtab_empty(&handle_cloner, &handle_free, &do_nothing);
+    if (!engine->shards || !engine->iters) ERROR("Out of memory for engine");
+    pthread_mutex_init(&(engine->lock), NULL);
+    pthread_cond_init(&(engine->done_cv), NULL);
+
+    for (int i = 0; i < shards_len; i++) {
+        shard_t* shard = calloc(1, sizeof(shard_t));
+        if (!shard) ERROR("Out of memory for engine");
+
+        shard->ops = malloc(sizeof(shard_op_t) * SHARD_QUEUE_CAP);
+        if (!shard->ops) ERROR("Out of memory for engine");
+        pthread_mutex_init(&(shard->lock), NULL);
+        pthread_cond_init(&(shard->wake_cv), NULL);
+        // Shard maps don't take references on their keys
+        shard->relations = bmap_empty(1, &handlecmp, &shallow_cloner, &do_nothing, &relinfo_free);
+        shard->idx = i;
+        shard->engine = engine;
+
+        engine->shards[i] = shard;
+        if (pthread_create(&(shard->thread), NULL, &shard_worker, shard) != 0)
+            ERROR("Could not start shard thread");
+    }
+
+    return engine;
+}
+
+// Send an op to every shard and wait until all of them processed it
+void engine_barrier(engine_t* engine, int type, entity_t* entity) {
+    pthread_mutex_lock(&(engine->lock));
+    engine->pending = engine->shards_len;
+    pthread_mutex_unlock(&(engine->lock));
+
+    for (int i = 0; i < engine->shards_len; i++)
+        shard_push(engine->shards[i], (shard_op_t) { type, NULL, entity, NULL });
+
+    pthread_mutex_lock(&(engine->lock));
+    while (engine->pending > 0)
+        pthread_cond_wait(&(engine->done_cv), &(engine->lock));
+    pthread_mutex_unlock(&(engine->lock));
+}
+
+// Dispatch addrel (is_add = 1) or delrel (is_add = 0) to the shard owning the relation
+void engine_rel_update(engine_t* engine, strtab_t* /* of entity_t */ entities,
+                       const char* txing_ent, const char* rxing_ent, const char* rel_id, int is_add) {
+    entity_t* tx_entity = ent_get(entities, txing_ent);
+    entity_t* rx_entity = ent_get(entities, rxing_ent);
+    if (!tx_entity || !rx_entity) {
+        STATS_INC(rel_dropped[is_add]);
+        return;
+    }
+
+    // Relations which are not in rels can't have edges to delete
+    uint32_t rel_hash = handle_hash(rel_id);
+    shard_t* shard = strtab_get(engine->rels, rel_id, rel_hash);
+    if (!shard) {
+        if (!is_add) return;
+
+        shard = engine->shards[rel_hash % engine->shards_len];
+        strtab_add(engine->rels, rel_id, rel_hash, shard);
+    }
+
+    shard_push(shard, (shard_op_t) {
+        is_add ? SHARD_OP_ADDREL : SHARD_OP_DELREL, rel_id, tx_entity, rx_entity });
+}
+
+// Delete an entity from every shard, and then from the database
+void engine_ent_del(engine_t* engine, strtab_t* /* of entity_t */ entities, const char* to_remove) {
+    strtab_slot_t* entity_slot = strtab_lookup(entities, to_remove, handle_hash(to_remove));
+
+    if (entity_slot) {
+        engine_barrier(engine, SHARD_OP_DELENT, (entity_t*) entity_slot->data);
+
+        // Entity id can only be recycled once it's gone from every tx set
+        strtab_remove_slot(entities, entity_slot);
+    }
+}
+
+// Stop pinning ids of relations which are gone from their shard (shards must be idle)
+void engine_trim_rels(engine_t* engine, int live_rels) {
+    if (engine->rels->len == live_rels) {
+        return;
+    }
+
+    int gone_len = 0;
+    strtab_slot_t* gone = malloc(sizeof(strtab_slot_t) * engine->rels->len);
+    if (!gone) ERROR("Out of memory for engine");
+
+    for (int i = 0; i < engine->rels->cap; i++) {
+        strtab_slot_t* slot = &(engine->rels->slots[i]);
+        bmap_t* relations = slot->key ? ((shard_t*) slot->data)->relations : NULL;
+
+        if (relations && !bmap_get(relations, slot->key)) {
+            gone[gone_len++] = *slot;
+        }
+    }
+    for (int i = 0; i < gone_len; i++) {
+        strtab_remove(engine->rels, gone[i].key, gone[i].hash);
+    }
+
+    free(gone);
+}
+
+// Print report, merging the segments rendered by each shard in key order
+void engine_report(engine_t* engine, FILE* out_f) {
+    engine_barrier(engine, SHARD_OP_REPORT, NULL);
+
+    report_buf.len = 0;
+
+    int live_rels = 0;
+    for (int i = 0; i < engine->shards_len; i++) {
+        engine->iters[i] = bmap_iter(engine->shards[i]->relations);
+        bmap_iter_next(&(engine->iters[i]));
+        live_rels += engine->shards[i]->relations->len;
+    }
+
+    if (live_rels == 0) {
+        outbuf_put(&report_buf, "none\n", 5);
+    } else {
+        for (;;) {
+            bmap_iter_t* min_it = NULL;
+            for (int i = 0; i < engine->shards_len; i++) {
+                bmap_iter_t* it = &(engine->iters[i]);
+                if (it->leaf && (!min_it || handlecmp(it->key, min_it->key) < 0))
+                    min_it = it;
+            }
+            if (!min_it) break;
+
+            relinfo_t* relinfo = (relinfo_t*) min_it->data;
+            outbuf_put(&report_buf, relinfo->report_seg.data, relinfo->report_seg.len);
+            bmap_iter_next(min_it);
+        }
+        STATS_ADD(segs_reported, live_rels);
+        outbuf_putc(&report_buf, '\n');
+    }
+
+    output_write(&report_buf, out_f);
+
+    engine_trim_rels(engine, live_rels);
+}
+
+// Print the top k rx ents of every relation (see report_top) once every shard is idle
+void engine_report_top(engine_t* engine, FILE* out_f, int k) {
+    engine_barrier(engine, SHARD_OP_SYNC, NULL);
+
+    bmap_t** relations = malloc(sizeof(bmap_t*) * engine->shards_len);
+    if (!relations) ERROR("Out of memory for report\n");
+    for (int i = 0; i < engine->shards_len; i++)
+        relations[i] = engine->shards[i]->relations;
+
+    report_top(out_f, relations, engine->shards_len, k);
+    free(relations);
+}
+
+// Print rank of an entity in a relation (see report_rank) once its shard is idle
+void engine_report_rank(engine_t* engine, FILE* out_f, const char* rxing_ent, const char* rel_id) {
+    engine_barrier(engine, SHARD_OP_SYNC, NULL);
+
+    shard_t* shard = (shard_t*) strtab_get(engine->rels, rel_id, handle_hash(rel_id));
+    report_rank(out_f, shard ? shard->relations : NULL, rxing_ent, rel_id);
+}
+
+// Print relations of every shard, one shard at a time
+void engine_print_relations(engine_t* engine, FILE* out_f) {
+    engine_barrier(engine, SHARD_OP_SYNC, NULL);
+
+    for (int i = 0; i < engine->shards_len; i++) {
+        bmap_print_with(out_f, engine->shards[i]->relations, &str_printer, &relinfo_print, PRINT_MODE_DB);
+        fprintf(out_f, "\n");
+    }
+}
+
+// Print stats (see stats_print) once every shard is idle
+void stats_print(FILE* out_f, strtab_t* /* of entity_t */ entities,
+                 bmap_t** /* of relinfo_t */ relations, int relations_len);
+void engine_stats_print(engine_t* engine, FILE* out_f, strtab_t* /* of entity_t */ entities) {
+    engine_barrier(engine, SHARD_OP_SYNC, NULL);
+
+    bmap_t** relations = malloc(sizeof(bmap_t*) * engine->shards_len);
+    if (!relations) ERROR("Out of memory for stats\n");
+    for (int i = 0; i < engine->shards_len; i++)
+        relations[i] = engine->shards[i]->relations;
+
+    stats_print(out_f, entities, relations, engine->shards_len);
+    free(relations);
+}
+
+// Stop shard threads and deallocate engine, along with every relation in it
+void engine_free(engine_t* engine) {
+    if (!engine) return;
+
+    for (int i = 0; i < engine->shards_len; i++) {
+        shard_t* shard = engine->shards[i];
+        shard_push(shard, (shard_op_t) { SHARD_OP_STOP, NULL, NULL, NULL });
+        pthread_join(shard->thread, NULL);
+
+        bmap_free(shard->relations);
+        pthread_mutex_destroy(&(shard->lock));
+        pthread_cond_destroy(&(shard->wake_cv));
+        free(shard->ops);
+        free(shard);
+    }
+
+    strtab_free(engine->rels);
+    pthread_mutex_destroy(&(engine->lock));
+    pthread_cond_destroy(&(engine->done_cv));
+    free(engine->iters);
+    free(engine->shards);
+    free(engine);
+}
+
+/**********************************************/
+/* Helper functions for handling program flow */
+/**********************************************/
+// Config constants
+#define DEBUG_ON  0
+#define DEBUG_OFF 1
+
+// Program options, given after the input and output files
+typedef struct config_t_ {
+    int debug_mode;     // "db" turns debug commands off
+    int batch_mode;     // "batch" buffers relation updates (see relbatch_t)
+    int threads;        // "threads=N" renders reports with N threads (see render_pool_t)
+    int shards;         // "shards=N" runs relations on N shard threads (see engine_t)
+    const char* load;   // "load=PATH" starts from a snapshot (see snapshot_load)
+    int compact_mode;   // "compact" writes a compacted command log instead of reports (see compactor_t)
+    int lazy_delete;    // "lazy" purges edges of deleted entities a few at a time (see ent_purger_t)
+    int pipeline;       // "pipeline" reads and writes on their own threads (see pipeline_t)
+} config_t;
+
+// Configure progam
+void configure(int argc, char** argv, FILE** in_f, FILE** out_f, config_t* config) {
+    // Set input file
+    if (argc > 1) *in_f = fopen(argv[1], "r");
+    else *in_f = stdin;
+
+    // Set output file
+    if (argc > 2) *out_f = fopen(argv[2], "w");
+    else *out_f = stdout;
+
+    // Set options
+    config->debug_mode = DEBUG_ON;
+    config->batch_mode = 0;
+    config->threads = 1;
+    config->shards = 0;
+    config->load = NULL;
+    config->compact_mode = 0;
+    config->lazy_delete = 0;
+    config->pipeline = 0;
+    for (int i = 3; i < argc; i++) {
+        if (strcmp(argv[i], "db") == 0) config->debug_mode = DEBUG_OFF;
+        else if (strcmp(argv[i], "batch") == 0) config->batch_mode = 1;
+        else if (strcmp(argv[i], "compact") == 0) config->compact_mode = 1;
+        else if (strcmp(argv[i], "lazy") == 0) config->lazy_delete = 1;
+        else if (strcmp(argv[i], "pipeline") == 0) config->pipeline = 1;
+        else if (strncmp(argv[i], "load=", 5) == 0) config->load = argv[i] + 5;
+        else if (sscanf(argv[i], "threads=%d", &(config->threads)) == 1) continue;
+        else if (sscanf(argv[i], "shards=%d", &(config->shards)) != 1) ERROR("Unrecognized option");
+    }
+    if (config->threads < 1) ERROR("Thread count must be positive");
+    if (config->shards < 0) ERROR("Shard count must be positive");
+    // Shards render their own reports and apply their updates right away
+    if (config->shards && (config->batch_mode || config->threads > 1))
+        ERROR("Shards can't be combined with batch mode or render threads");
+    if (config->shards && config->load)
+        ERROR("Shards can't be combined with snapshots");
+    // The compacted log starts from an empty database
+    if (config->compact_mode && (config->shards || config->load))
+        ERROR("Compacting can't be combined with shards or snapshots");
+    // Shards delete entities with a barrier anyway
+    if (config->lazy_delete && config->shards)
+        ERROR("Lazy deletion can't be combined with shards");
+}
+
+// Input config constants
+#define READER_BLOCK_BYTES (1 << 20)
+
+/*****************************************************************************/
+/* Input reader. Regular files are memory mapped, anything else (e.g. stdin) */
+/* is read in large blocks, always holding at least a whole line, as well as */
+/* the command being read. Tokens are returned as slices pointing straight   */
+/* into the input.                                                           */
+/*****************************************************************************/
+typedef struct reader_t_ {
+    int fd;
+    const char* buf;    // mapped file or block buffer
+    size_t len;         // amount of valid bytes in buf
+    size_t pos;         // first unread byte
+    size_t mark;        // start of the command being read, kept in buf on refills
+    int is_mapped;
+    int eof;            // 1 once no more data can be read into buf
+    char* block;        // block buffer (NULL if mapped)
+    size_t block_cap;
+} reader_t;
+
+// Initialize reader on given stream
+void reader_init(reader_t* reader, FILE* in_f) {
+    NULLCHECK2(reader, in_f);
+
+    struct stat in_stat;
+
+    reader->fd = fileno(in_f);
+    reader->pos = 0;
+    reader->mark = 0;
+    reader->block = NULL;
+    reader->block_cap = 0;
+
+    if (fstat(reader->fd, &in_stat) == 0 && S_ISREG(in_stat.st_mode) && in_stat.st_size > 0) {
+        void* mapped = mmap(NULL, in_stat.st_size, PROT_READ, MAP_PRIVATE, reader->fd, 0);
+
+        if (mapped != MAP_FAILED) {
+            madvise(mapped, in_stat.st_size, MADV_SEQUENTIAL);
+
+            reader->buf = (const char*) mapped;
+            reader->len = in_stat.st_size;
+            reader->is_mapped = 1;
+            reader->eof = 1;
+            return;
+        }
+    }
+
+    // Fall back to reading blocks
+    reader->block_cap = READER_BLOCK_BYTES;
+    reader->block = malloc(reader->block_cap);
+    reader->buf = reader->block;
+    reader->len = 0;
+    reader->is_mapped = 0;
+    reader->eof = 0;
+}
+
+// Release reader resources
+void reader_close(reader_t* reader) {
+    if (reader->is_mapped) munmap((void*) reader->buf, reader->len);
+    else                   free(reader->block);
+}
+
+// Move data from the mark on to the front of the block buffer and read some more
+void reader_refill(reader_t* reader) {
+    assert(!reader->is_mapped && reader->mark <= reader->pos);
+
+    memmove(reader->block, reader->block + reader->mark, reader->len - reader->mark);
+    reader->len -= reader->mark;
+    reader->pos -= reader->mark;
+    reader->mark = 0;
+
+    if (reader->len == reader->block_cap) {
+        reader->block_cap *= 2;
+        reader->block = realloc(reader->block, reader->block_cap);
+    }
+    reader->buf = reader->block;
+
+    ssize_t read_len = read(reader->fd, reader->block + reader->len, reader->block_cap - reader->len);
+    if (read_len <= 0) reader->eof = 1;
+    else               reader->len += read_len;
+}
+
+// Skip to the beginning of the next line with content, making sure that all of it is
+// in the buffer (so that the slices taken from it stay valid), and mark it as the start
+// of the next command. Returns 0 at end of input
+int reader_next_line(reader_t* reader) {
+    while (1) {
+        while (reader->pos < reader->len && isspace((unsigned char) reader->buf[reader->pos]))
+            reader->pos++;
+
+        reader->mark = reader->pos;
+        if (reader->pos < reader->len) break;
+        if (reader->eof) return 0;
+
+        reader_refill(reader);
+    }
+
+    while (!reader->eof && !memchr(reader->buf + reader->pos, '\n', reader->len - reader->pos))
+        reader_refill(reader);
+
+    return 1;
+}
+
+// Index of the first whitespace (as told by isspace) in buf from pos on, len if there's
+// none. With SSE2 16 bytes are checked at a time, the tail is checked one by one
+size_t find_space(const char* buf, size_t pos, size_t len) {
+#ifdef __SSE2__
+    const __m128i space = _mm_set1_epi8(' ');
+    const __m128i ctrl_first = _mm_set1_epi8('\t');  // \t \n \v \f \r are contiguous
+    const __m128i ctrl_last = _mm_set1_epi8('\r');
+
+    for (; pos + 16 <= len; pos += 16) {
+        __m128i bytes = _mm_loadu_si128((const __m128i*) (buf + pos));
+        __m128i is_ctrl = _mm_and_si128(_mm_cmpeq_epi8(_mm_max_epu8(bytes, ctrl_first), bytes),
+                                        _mm_cmpeq_epi8(_mm_min_epu8(bytes, ctrl_last), bytes));
+        int mask = _mm_movemask_epi8(_mm_or_si128(is_ctrl, _mm_cmpeq_epi8(bytes, space)));
+
+        if (mask) return pos + __builtin_ctz(mask);
+    }
+#endif
+    while (pos < len && !isspace((unsigned char) buf[pos]))
+        pos++;
+
+    return pos;
+}
+
+// Get next whitespace delimited token of the current line (empty if there is none)
+slice_t reader_token(reader_t* reader) {
+    const char* buf = reader->buf;
+
+    // Tokens are mostly one space apart, it's not worth skipping more at a time
+    while (reader->pos < reader->len && buf[reader->pos] != '\n' &&
+            isspace((unsigned char) buf[reader->pos]))
+        reader->pos++;
+
+    slice_t result = { buf + reader->pos, 0 };
+    reader->pos = find_space(buf, reader->pos, reader->len);
+    result.len = buf + reader->pos - result.ptr;
+
+    return result;
+}
+
+// Get next whitespace delimited token, skipping newlines as well (empty at end of input).
+//  NB. reading past the current line may move the buffer, slices taken before are only
+//  good as offsets from the mark
+slice_t reader_arg(reader_t* reader) {
+    while (1) {
+        while (reader->pos < reader->len && isspace((unsigned char) reader->buf[reader->pos]))
+            reader->pos++;
+
+        if (reader->pos < reader->len || reader->eof) break;
+        reader_refill(reader);
+    }
+
+    size_t end;
+    while ((end = find_space(reader->buf, reader->pos, reader->len)) == reader->len &&
+            !reader->eof)
+        reader_refill(reader);
+
+    slice_t result = { reader->buf + reader->pos, end - reader->pos };
+    reader->pos = end;
+
+    return result;
+}
+
+// 1 if slice holds exactly the given string
+int slice_eq(slice_t slice, const char* str) {
+    return strncmp(slice.ptr, str, slice.len) == 0 && str[slice.len] == '\0';
+}
+
+// Command heads, all of them at most 8 bytes long so that a head can be told apart
+// with a single compare of its bytes (zero padded) taken as a word
+#define CMD_UNKNOWN 0
+#define CMD_ADDREL 1
+#define CMD_DELREL 2
+#define CMD_ADDENT 3
+#define CMD_DELENT 4
+#define CMD_REPORT 5
+#define CMD_RANK 6
+#define CMD_SAVE 7
+#define CMD_LOAD 8
+#define CMD_GENT 9
+#define CMD_PENT 10
+#define CMD_PREL 11
+#define CMD_STATS 12
+#define CMD_END 13
+#define CMD_KINDS 14
+const char* cmd_heads[CMD_KINDS] = {
+    "", "addrel", "delrel", "addent", "delent", "report", "rank",
+    "save", "load", "gent", "pent", "prel", "stats", "end"
+};
+uint64_t cmd_head_words[CMD_KINDS];
+
+// Bytes of a head (up to 8) as a zero padded word
+uint64_t cmd_head_word(const char* head, size_t len) {
+    uint64_t result = 0;
+    memcpy(&result, head, len);
+    return result;
+}
+
+void initialize_cmd_heads() {
+    for (int kind = 0; kind < CMD_KINDS; kind++)
+        cmd_head_words[kind] = cmd_head_word(cmd_heads[kind], strlen(cmd_heads[kind]));
+}
+
+// Kind of command with a given head (CMD_UNKNOWN if there's no such command)
+int cmd_classify(slice_t head) {
+    if (head.len == 0 || head.len > sizeof(uint64_t)) {
+        return CMD_UNKNOWN;
+    }
+
+    uint64_t word = cmd_head_word(head.ptr, head.len);
+    for (int kind = 1; kind < CMD_KINDS; kind++)
+        if (cmd_head_words[kind] == word) return kind;
+
+    return CMD_UNKNOWN;
+}
+
+// Scan quoted string used for entity and relation ids, returning it without quotes
+slice_t scan_id(slice_t token) {
+    slice_t result = token;
+
+    // Check validity
+    if (result.len < 2 || result.ptr[0] != '"' || result.ptr[result.len - 1] != '"') {
+        ERROR("Malformed id\n");
+    }
+
+    // Remove "(s)
+    result.ptr++;
+    result.len -= 2;
+
+    return result;
+}
+
+// 1 if slice is a non empty sequence of digits
+int slice_is_number(slice_t slice) {
+    for (size_t i = 0; i < slice.len; i++) {
+        if (!isdigit((unsigned char) slice.ptr[i])) return 0;
+    }
+    return slice.len > 0;
+}
+
+// Parse positive decimal number
+int slice_to_count(slice_t slice) {
+    long long result = 0;
+
+    for (size_t i = 0; i < slice.len; i++) {
+        if (!isdigit((unsigned char) slice.ptr[i]) || result > INT_MAX / 10)
+            ERROR("Malformed count\n");
+        result = result * 10 + (slice.ptr[i] - '0');
+    }
+    if (slice.len == 0 || result == 0 || result > INT_MAX)
+        ERROR("Malformed count\n");
+
+    return (int) result;
+}
+
+// Command along with the tokens it takes. Arguments may continue on the following lines,
+// as they did when read with fscanf, and are empty past the end of the input. Whatever
+// follows them on their line makes up the next command
+#define CMD_MAX_ARGS 3
+typedef struct cmd_t_ {
+    int kind;
+    slice_t head;
+    slice_t args[CMD_MAX_ARGS];
+} cmd_t;
+
+// Amount of arguments required by each kind of command. Besides them, report takes an
+// optional count, only from its own line and only if it is a number
+const int cmd_arities[CMD_KINDS] = { 0, 3, 3, 1, 1, 0, 2, 1, 1, 1, 0, 0, 0, 0 };
+
+// Read next command, starting from the current line
+void cmd_scan(reader_t* reader, cmd_t* cmd) {
+    // Tokens are kept as offsets from the mark until all of them are read, since the
+    // buffer may move while reading arguments from the following lines
+    slice_t head = reader_token(reader);
+    size_t head_offset = head.ptr - (reader->buf + reader->mark);
+    size_t offsets[CMD_MAX_ARGS];
+
+    cmd->kind = cmd_classify(head);
+    cmd->head.len = head.len;
+
+    int arity = cmd_arities[cmd->kind];
+    for (int i = 0; i < CMD_MAX_ARGS; i++) {
+        slice_t arg = i < arity ? reader_arg(reader) : (slice_t) { reader->buf + reader->pos, 0 };
+
+        offsets[i] = arg.ptr - (reader->buf + reader->mark);
+        cmd->args[i].len = arg.len;
+    }
+
+    if (cmd->kind == CMD_REPORT) {
+        size_t pos = reader->pos;
+        slice_t count = reader_token(reader);
+
+        // Anything else is left for the next command
+        if (slice_is_number(count)) {
+            offsets[0] = count.ptr - (reader->buf + reader->mark);
+            cmd->args[0].len = count.len;
+        } else {
+            reader->pos = pos;
+        }
+    }
+
+    const char* start = reader->buf + reader->mark;
+    cmd->head.ptr = start + head_offset;
+    for (int i = 0; i < CMD_MAX_ARGS; i++) {
+        cmd->args[i].ptr = start + offsets[i];
+    }
+}
+
+/*****************************************************************************/
+/* Pipelined input. With the pipeline option a reader thread reads commands  */
+/* and splits them in tokens, copied in chunks. The main thread applies them */
+/* and hands its output to the writer thread (see writer_t), so reading,     */
+/* applying and writing overlap.                                             */
+/*****************************************************************************/
+#define PIPE_CHUNK_CMDS 4096        // commands per chunk
+#define PIPE_CHUNK_BYTES (1 << 18)  // token text per chunk (more if a command needs it)
+#define PIPE_CHUNKS 8               // chunks in flight, bounding buffered input
+
+typedef struct cmd_chunk_t_ {
+    cmd_t cmds[PIPE_CHUNK_CMDS];
+    int len;
+    int pos;            // next command to apply
+    char* text;         // tokens of the commands
+    size_t text_len;
+    size_t text_cap;
+} cmd_chunk_t;
+
+typedef struct pipeline_t_ {
+    reader_t* reader;       // only used by the reader thread
+    cmd_chunk_t* chunks[PIPE_CHUNKS];
+    cmd_chunk_t* cur;       // chunk being applied
+    pipe_queue_t full;      // chunks waiting to be applied
+    pipe_queue_t empty;     // chunks applied, to be filled again
+    pthread_t thread;
+} pipeline_t;
+
+// Copy token in the text of a chunk
+slice_t cmd_chunk_put(cmd_chunk_t* chunk, slice_t token) {
+    slice_t result = { chunk->text + chunk->text_len, token.len };
+
+    memcpy(chunk->text + chunk->text_len, token.ptr, token.len);
+    chunk->text_len += token.len;
 
     return result;
 }
-void* v_relinfo_empty() {
-    return (void*) relinfo_empty();
+
+// Copy command at the end of a chunk, if there's room for it
+int cmd_chunk_add(cmd_chunk_t* chunk, const cmd_t* cmd) {
+    size_t cmd_len = cmd->head.len;
+    for (int i = 0; i < CMD_MAX_ARGS; i++)
+        cmd_len += cmd->args[i].len;
+
+    if (chunk->len == PIPE_CHUNK_CMDS || chunk->text_len + cmd_len > chunk->text_cap) {
+        if (chunk->len > 0) return 0;
+
+        // Text may only move while no token points to it
+        chunk->text_cap = cmd_len;
+        chunk->text = realloc(chunk->text, chunk->text_cap);
+        if (!chunk->text) ERROR("Out of memory for pipeline\n");
+    }
+
+    cmd_t* copy = &(chunk->cmds[chunk->len++]);
+    copy->kind = cmd->kind;
+    copy->head = cmd_chunk_put(chunk, cmd->head);
+    for (int i = 0; i < CMD_MAX_ARGS; i++)
+        copy->args[i] = cmd_chunk_put(chunk, cmd->args[i]);
+
+    return 1;
 }
 
-// 1 if relinfo is empty, 0 otherwise 
-int relinfo_is_empty(const relinfo_t* relinfo) {
-    return relinfo->rxing_ents_map->len == 0;
+// 1 if the reader holds a whole command, so that it can be read without waiting
+int reader_has_cmd(const reader_t* reader) {
+    const char* buf = reader->buf;
+    size_t pos = reader->pos;
+
+    if (reader->eof) return 1;
+
+    // The line of the head (and of the optional count) has to be whole
+    while (pos < reader->len && isspace((unsigned char) buf[pos]))
+        pos++;
+    if (!memchr(buf + pos, '\n', reader->len - pos)) return 0;
+
+    size_t end = find_space(buf, pos, reader->len);
+    int arity = cmd_arities[cmd_classify((slice_t) { buf + pos, end - pos })];
+
+    // Arguments have to end before the end of the buffer
+    for (int i = 0; i < arity; i++) {
+        pos = end;
+        while (pos < reader->len && isspace((unsigned char) buf[pos]))
+            pos++;
+
+        end = find_space(buf, pos, reader->len);
+        if (end == reader->len) return 0;
+    }
+
+    return 1;
 }
 
-// Custom printer for relinfo entries in maps
-void relinfo_print(FILE* out_f, const void* v_relinfo) {
-    fputs("ri< ", out_f);
+// Reader thread. It may only be cancelled while waiting for input
+void* pipeline_run(void* pipeline_v) {
+    pipeline_t* pipeline = (pipeline_t*) pipeline_v;
+    reader_t* reader = pipeline->reader;
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+
+    cmd_chunk_t* chunk = pipe_queue_pop(&(pipeline->empty), 1);
+    while (chunk) {
+        // Commands read so far are handed over before waiting for more
+        if (!reader_has_cmd(reader) && chunk->len > 0) {
+            if (!pipe_queue_push(&(pipeline->full), chunk)) break;
+            chunk = pipe_queue_pop(&(pipeline->empty), 1);
+            continue;
+        }
 
-    relinfo_t* relinfo = (relinfo_t*) v_relinfo;
+        // Arguments on the following lines may have to be waited for as well
+        cmd_t cmd;
+        pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+        int has_line = reader_next_line(reader);
+        if (has_line) cmd_scan(reader, &cmd);
+        pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+        if (!has_line) {
+            pipe_queue_push(&(pipeline->full), chunk);
+            break;
+        }
 
-    if (!relinfo) {
-        puts("NULL");
-    } else {
-        map_print_with(out_f, relinfo->rxing_ents_map, &str_printer, &strset_printer,
-                PRINT_MODE_DB);
-        fputs(", ", out_f);
-        map_print_with(out_f, relinfo->rxing_amounts_map, &int_printer, &strset_printer,
-                PRINT_MODE_DB);
+        if (!cmd_chunk_add(chunk, &cmd)) {
+            if (!pipe_queue_push(&(pipeline->full), chunk)) break;
+            chunk = pipe_queue_pop(&(pipeline->empty), 1);
+            if (chunk) cmd_chunk_add(chunk, &cmd);
+        }
     }
 
-    fputs(" >", out_f);
+    pipe_queue_close(&(pipeline->full));
+    return NULL;
 }
 
-/*******************************************/
-/* Helper functions for handling relations */
-/*******************************************/
-// Add a relation to the database
-// TODO: check for malformed relations (such as those among entities that do not exist)  
-// TODO OPT: do not clone keys everytime (rel_id, rxing_ent and txin_end are cloned w\ strclone everytime)
-void rel_add(map_t* /* of str */ entities, map_t* /* of relinfo_t */ relations,
-             const char* txing_ent, const char* rxing_ent, const char* rel_id) {
-    if (!map_get(entities, txing_ent) || !map_get(entities, rxing_ent)) {
-        return;
+pipeline_t* pipeline_new(reader_t* reader) {
+    pipeline_t* result = malloc(sizeof(pipeline_t));
+    if (!result) ERROR("Out of memory for pipeline\n");
+
+    result->reader = reader;
+    result->cur = NULL;
+    pipe_queue_init(&(result->full), PIPE_CHUNKS);
+    pipe_queue_init(&(result->empty), PIPE_CHUNKS);
+    for (int i = 0; i < PIPE_CHUNKS; i++) {
+        cmd_chunk_t* chunk = malloc(sizeof(cmd_chunk_t));
+        if (!chunk) ERROR("Out of memory for pipeline\n");
+
+        chunk->len = chunk->pos = 0;
+        chunk->text_len = 0;
+        chunk->text_cap = PIPE_CHUNK_BYTES;
+        chunk->text = malloc(chunk->text_cap);
+        if (!chunk->text) ERROR("Out of memory for pipeline\n");
+
+        result->chunks[i] = chunk;
+        pipe_queue_push(&(result->empty), chunk);
     }
 
-    relinfo_t* relinfo = map_get_or(relations, rel_id, &v_relinfo_empty);
+    if (pthread_create(&(result->thread), NULL, &pipeline_run, result) != 0)
+        ERROR("Could not start reader thread\n");
 
-    intptr_t curr_tx_amount = 0; 
+    return result;
+}
 
-    // Associate rx_ent to tx_ent in rxing_ents_map.
-    // Map layout: rx_map = {rxing_ent, tx_set = {txing_ent}}
-    map_t* rx_map = NOTNULL(relinfo->rxing_ents_map);
-    map_t* tx_set = map_get_or(rx_map, rxing_ent, &v_strset_empty); // TODO: OPT: 
-    int add_res = set_add(tx_set, txing_ent);
-    curr_tx_amount = tx_set->len;
-
-    // Update tx_amounts_map with new rx_ents amount associated with inserted tx_ent.
-    // Map layout: amm_map = {rx_amm, rx_set = {}};
-    // where rx_amm is an int indicating the number of times the entities in the associated
-    // rx_set are found at the receiving end of a relation.
-    //  NB. this is just kept updated for optimization purposes
-    if (add_res == MAP_OK) {
-        // Since this function can't fail to add a new relation, the amount of
-        // tx ents that the rx ent of this relation must have increased
-        assert(curr_tx_amount > 0); 
+// Get next command read by the reader thread, returns 0 at end of input.
+// Tokens stay valid until the following call
+int pipeline_next(pipeline_t* pipeline, cmd_t* cmd) {
+    cmd_chunk_t* chunk = pipeline->cur;
+
+    while (!chunk || chunk->pos == chunk->len) {
+        if (chunk) {
+            chunk->len = chunk->pos = 0;
+            chunk->text_len = 0;
+            pipe_queue_push(&(pipeline->empty), chunk);
+        }
 
-        // Remove rx_ent from previous rx_set associated with old tx amount
-        map_t* amm_map = NOTNULL(relinfo->rxing_amounts_map);
-        map_inner_remove(amm_map, (const void*) (curr_tx_amount - 1), (const void*) rxing_ent);
+        // Output is handed over before waiting for input
+        chunk = pipe_queue_pop(&(pipeline->full), 0);
+        if (!chunk) {
+            if (writer) writer_flush(writer);
+            chunk = pipe_queue_pop(&(pipeline->full), 1);
+        }
 
-        // Place rx in rx set associated with its updated tx amount
-        map_t* curr_rx_set = map_get_or(amm_map, (void*) curr_tx_amount, &v_strset_empty);
-        set_add(curr_rx_set, rxing_ent);
+        pipeline->cur = chunk;
+        if (!chunk) return 0;
     }
+
+    *cmd = chunk->cmds[chunk->pos++];
+    return 1;
 }
 
-// Deletes relation from database
-// TODO: find a way to simulate currying and abstract cleanup 
-//       into higher order function
-void rel_del(map_t* /* of relinfo_t */ relations,
-             const char* txing_ent, const char* rxing_ent, const char* rel_id) {
-    // Get relinfo relative to removed relation
-    map_node_t** relinfo_node_ref = node_get_ref(&(relations->root), rel_id, relations->comp);
+// Get next command, through the pipeline if there is one
+int cmd_next(pipeline_t* pipeline, reader_t* reader, cmd_t* cmd) {
+    if (pipeline) {
+        return pipeline_next(pipeline, cmd);
+    }
 
-    // Exit if relation to remove doesn't exist
-    if (!(*relinfo_node_ref)) {
+    if (!reader_next_line(reader)) {
+        return 0;
+    }
+    cmd_scan(reader, cmd);
+    return 1;
+}
+
+// Stop reader thread (even if waiting for input) and deallocate pipeline
+void pipeline_free(pipeline_t* pipeline) {
+    if (!pipeline) {
         return;
     }
 
-    relinfo_t* relinfo = (relinfo_t*) ((*relinfo_node_ref)->data);
+    pipe_queue_close(&(pipeline->empty));
+    pipe_queue_close(&(pipeline->full));
+    pthread_cancel(pipeline->thread);
+    pthread_join(pipeline->thread, NULL);
 
-    // Remove rxing_ent and txing_ent
-    // TODO OPT: see if this is better left as is or if removing it is better
-    //           (removal would entail speed^/mem^ opt).
-    int txs_len;
-    int removal_res = map_inner_remove_get_len(relinfo->rxing_ents_map, 
-            (const void*) rxing_ent, 
-            (const void*) txing_ent,
-            &txs_len);
+    for (int i = 0; i < PIPE_CHUNKS; i++) {
+        free(pipeline->chunks[i]->text);
+        free(pipeline->chunks[i]);
+    }
+    pipe_queue_destroy(&(pipeline->full));
+    pipe_queue_destroy(&(pipeline->empty));
+    free(pipeline);
+}
 
-    if (removal_res == MAP_OK) {
-        // Update tx_ammount cache
-        map_inner_remove(relinfo->rxing_amounts_map,
-                (const void*) (intptr_t) (txs_len + 1),
-                (const void*) rxing_ent);
-        if (txs_len > 0) {
-            set_add(map_get_or(
-                        relinfo->rxing_amounts_map, 
-                        (const void*) (intptr_t) txs_len,
-                        &v_strset_empty),
-                    (const void*) rxing_ent);
-        }
+/**************************************************************************/
+/* Benchmark instrumentation. Only compiled in with -DBENCH: the latency  */
+/* of every command is sampled and a summary is printed to stderr at exit */
+/**************************************************************************/
+// Command types told apart by instrumentation, the last one gathers all the others
+#define CMD_TYPES 6
+const char* cmd_type_names[CMD_TYPES] = {
+    "addent", "delent", "addrel", "delrel", "report", "other"
+};
+
+// Get type of a command given its head
+int cmd_type_of(slice_t command) {
+    for (int i = 0; i < CMD_TYPES - 1; i++) {
+        if (slice_eq(command, cmd_type_names[i]))
+            return i;
+    }
+    return CMD_TYPES - 1;
+}
+
+// Monotonic timestamp in nanoseconds
+uint64_t now_ns() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+#ifdef BENCH
+
+typedef struct bench_samples_t_ {
+    uint64_t* ns;
+    size_t len;
+    size_t cap;
+} bench_samples_t;
+
+bench_samples_t bench_samples[CMD_TYPES];
+uint64_t bench_start_ns;
+
+// Record latency of a command given its head
+void bench_record(slice_t command, uint64_t ns) {
+    bench_samples_t* samples = &(bench_samples[cmd_type_of(command)]);
+    if (samples->len == samples->cap) {
+        samples->cap = samples->cap ? samples->cap * 2 : 1024;
+        samples->ns = realloc(samples->ns, sizeof(uint64_t) * samples->cap);
+    }
+    samples->ns[samples->len++] = ns;
+}
 
-        // Cleanup relinfo if empty
-        if (relinfo_is_empty(relinfo))  {
-            node_free(node_remove(relinfo_node_ref, relations->comp),
-                    relations->free_key,
-                    relations->free_element);
+// Comparison function for sorting samples
+int bench_ns_cmp(const void* lhs, const void* rhs) {
+    uint64_t l = *(const uint64_t*) lhs, r = *(const uint64_t*) rhs;
+    return l < r ? -1 : l > r;
+}
+
+// Print throughput and latency percentiles, then release samples
+void bench_summary(FILE* out_f) {
+    double total_s = (now_ns() - bench_start_ns) / 1e9;
+    size_t total_cmds = 0;
+    for (int i = 0; i < CMD_TYPES; i++)
+        total_cmds += bench_samples[i].len;
+
+    fprintf(out_f, "%zu commands in %.3f s (%.0f ops/s)\n",
+            total_cmds, total_s, total_s > 0 ? total_cmds / total_s : 0.0);
+    fprintf(out_f, "%-8s %10s %10s %10s %10s %10s %12s\n",
+            "command", "count", "p50 ns", "p90 ns", "p99 ns", "max ns", "total ms");
+
+    for (int i = 0; i < CMD_TYPES; i++) {
+        bench_samples_t* samples = &(bench_samples[i]);
+        if (samples->len == 0) continue;
+
+        qsort(samples->ns, samples->len, sizeof(uint64_t), &bench_ns_cmp);
+
+        uint64_t sum = 0;
+        for (size_t s = 0; s < samples->len; s++)
+            sum += samples->ns[s];
+
+        fprintf(out_f, "%-8s %10zu %10" PRIu64 " %10" PRIu64 " %10" PRIu64 " %10" PRIu64 " %12.2f\n",
+                cmd_type_names[i], samples->len,
+                samples->ns[samples->len * 50 / 100],
+                samples->ns[samples->len * 90 / 100],
+                samples->ns[samples->len * 99 / 100],
+                samples->ns[samples->len - 1],
+                sum / 1e6);
+
+        free(samples->ns);
+    }
+}
+
+#define BENCH_BEGIN() (bench_start_ns = now_ns())
+#define BENCH_CMD_START() uint64_t bench_cmd_start_ns = now_ns()
+#define BENCH_CMD_STOP(command) bench_record(command, now_ns() - bench_cmd_start_ns)
+#define BENCH_END() bench_summary(stderr)
+#else
+#define BENCH_BEGIN()
+#define BENCH_CMD_START()
+#define BENCH_CMD_STOP(command)
+#define BENCH_END()
+#endif
+
+/*****************************************************************************/
+/* Statistics dumped by the stats command. Latency histograms (one for every */
+/* command type, with power of two buckets) and the counters are only there  */
+/* with -DSTATS, B-tree shapes are measured on demand.                       */
+/*****************************************************************************/
+#ifdef STATS
+#define STATS_BUCKETS 40    // bucket b holds latencies in [2^(b-1), 2^b) ns, the last one the rest
+
+typedef struct stats_hist_t_ {
+    uint64_t count;
+    uint64_t total_ns;
+    uint64_t max_ns;
+    uint64_t buckets[STATS_BUCKETS];
+} stats_hist_t;
+
+stats_hist_t stats_hists[CMD_TYPES];
+
+// Record latency of a command given its head
+void stats_record(slice_t command, uint64_t ns) {
+    stats_hist_t* hist = &(stats_hists[cmd_type_of(command)]);
+
+    int bucket = ns ? 64 - __builtin_clzll(ns) : 0;
+    if (bucket >= STATS_BUCKETS) bucket = STATS_BUCKETS - 1;
+
+    hist->count++;
+    hist->total_ns += ns;
+    if (ns > hist->max_ns) hist->max_ns = ns;
+    hist->buckets[bucket]++;
+}
+
+// Print latency histograms and counters
+void stats_print_counters(FILE* out_f) {
+    for (int i = 0; i < CMD_TYPES; i++) {
+        stats_hist_t* hist = &(stats_hists[i]);
+        if (hist->count == 0) continue;
+
+        fprintf(out_f, "%-8s count %" PRIu64 ", avg %" PRIu64 " ns, max %" PRIu64 " ns\n",
+                cmd_type_names[i], hist->count, hist->total_ns / hist->count, hist->max_ns);
+        for (int b = 0; b < STATS_BUCKETS; b++) {
+            if (hist->buckets[b] == 0) continue;
+            fprintf(out_f, "    < 2^%-2d ns %12" PRIu64 "\n", b, hist->buckets[b]);
         }
     }
+
+    fprintf(out_f, "addrel dropped: %" PRIu64 ", delrel dropped: %" PRIu64 "\n",
+            STATS_GET(rel_dropped[1]), STATS_GET(rel_dropped[0]));
+    fprintf(out_f, "report segments: %" PRIu64 " output, %" PRIu64 " rendered\n",
+            STATS_GET(segs_reported), STATS_GET(segs_rendered));
+    fprintf(out_f, "slab objects: %" PRIu64 " allocated, %" PRIu64 " freed, %" PRIu64 " slabs (%" PRIu64 " KiB)\n",
+            STATS_GET(slab_allocs), STATS_GET(slab_frees), STATS_GET(slabs), STATS_GET(slabs) * SLAB_BYTES / 1024);
+    fprintf(out_f, "large objects: %" PRIu64 " allocated\n", STATS_GET(large_allocs));
 }
 
-// Delete an entity and all of its relations
-void ent_del_update_relinfo(map_t* relations, map_node_t** cur_ri_node_ref, const char* to_remove);
-void ent_del_update_tx_and_amm(relinfo_t* relinfo, map_node_t** cur_txs_node, const char* to_remove);
-void ent_del(map_t* /* or str */ entities, map_t* /* of relinfo */ relations, const char* to_remove) {
-    // TODO: consider if this is useful
-    if (map_remove(entities, (const void*) to_remove) == MAP_OK) {
-        ent_del_update_relinfo(relations, &(relations->root), to_remove);
+#define STATS_CMD_START() uint64_t stats_cmd_start_ns = now_ns()
+#define STATS_CMD_STOP(command) stats_record(command, now_ns() - stats_cmd_start_ns)
+#else
+void stats_print_counters(FILE* out_f) {
+    fprintf(out_f, "counters: not compiled in (build with -DSTATS)\n");
+}
+
+#define STATS_CMD_START()
+#define STATS_CMD_STOP(command)
+#endif
+
+// Shape of a set of B-trees
+typedef struct tree_shape_t_ {
+    int trees;
+    uint64_t entries;
+    uint64_t nodes;
+    int max_height;
+} tree_shape_t;
+
+// Count nodes of a subtree, recursion depth is the height of the tree
+uint64_t bmap_node_count(const bmap_node_t* node) {
+    uint64_t result = 1;
+
+    if (!node->is_leaf) {
+        for (int i = 0; i < node->len; i++)
+            result += bmap_node_count((const bmap_node_t*) node->slots[i]);
     }
+    return result;
 }
-// Helper function for recursion
-void ent_del_update_relinfo(map_t* relations, map_node_t** cur_ri_node_ref, const char* to_remove) {
-    map_node_t* cur_ri_node = *NOTNULL(cur_ri_node_ref);
 
-    if (cur_ri_node) {
-        // Recursive walk
-        ent_del_update_relinfo(relations, &(cur_ri_node->left), to_remove);
-        ent_del_update_relinfo(relations, &(cur_ri_node->right), to_remove);
+// Add a tree to its shape
+void tree_shape_add(tree_shape_t* shape, const bmap_t* map) {
+    shape->trees++;
+    shape->entries += map->len;
+    if (map->root) shape->nodes += bmap_node_count(map->root);
+    if (map->height > shape->max_height) shape->max_height = map->height;
+}
 
-        relinfo_t* relinfo = (relinfo_t*) cur_ri_node->data;
-        map_t* rxs_map = relinfo->rxing_ents_map;
+void tree_shape_print(FILE* out_f, const char* name, const tree_shape_t* shape) {
+    fprintf(out_f, "%s: %d trees, %" PRIu64 " entries in %" PRIu64 " nodes (%.2f per node), max height %d\n",
+            name, shape->trees, shape->entries, shape->nodes,
+            shape->nodes ? (double) shape->entries / shape->nodes : 0.0, shape->max_height);
+}
 
-        // Update tx_set associated with current rx ent
-        ent_del_update_tx_and_amm(relinfo, &(relinfo->rxing_ents_map->root), to_remove);
+// Print everything known about the database and the commands run so far. Relations
+// may be split among many maps (one for each shard)
+void stats_print(FILE* out_f, strtab_t* /* of entity_t */ entities,
+                 bmap_t** /* of relinfo_t */ relations, int relations_len) {
+    stats_print_counters(out_f);
 
-        // Tx-amm update could have left relinfo empty and in need of deallocation
-        if (relinfo_is_empty(relinfo)) {
-            map_node_t* node_to_remove = node_remove(cur_ri_node_ref, relations->comp);
-            relations->len--;
-            assert(node_to_remove);
-            node_free(node_to_remove, relations->free_key, relations->free_element);
+    fprintf(out_f, "entities: %d, interned strings: %d\n", entities->len, intern_pool->len);
 
-            return;
-        }
+    tree_shape_t rels_shape = { 0, 0, 0, 0 };
+    tree_shape_t rxs_shape = { 0, 0, 0, 0 };
+    for (int i = 0; i < relations_len; i++) {
+        tree_shape_add(&rels_shape, relations[i]);
+        for (bmap_iter_t it = bmap_iter(relations[i]); bmap_iter_next(&it);)
+            tree_shape_add(&rxs_shape, ((relinfo_t*) it.data)->rxing_ents_map);
+    }
 
-        // Get reference to node to remove to extract length of
-        // associated txs_set
-        map_node_t** node_to_remove_ref = node_get_ref(&(rxs_map->root),
-                (const void*) to_remove,
-                rxs_map->comp);
-        if (!(*node_to_remove_ref)) {
-            // Nothing left to do if no node to remove
-            return;
+    tree_shape_print(out_f, "relations", &rels_shape);
+    tree_shape_print(out_f, "rxing_ents_map", &rxs_shape);
+}
+
+// Initialize global id interning pool
+void initialize_intern_pool() {
+    intern_pool = intern_pool_empty();
+}
+
+// Initialize empty entity storage
+strtab_t* initialize_entities() {
+    return strtab_empty(&handle_cloner, &handle_free, &entity_free);
+}
+
+// Initialize empty relations storage
+bmap_t* initialize_relations() {
+    return bmap_empty(1, &handlecmp, &handle_cloner, &handle_free, &relinfo_free);
+}
+
+/*****************************************************************************/
+/* Snapshots. The whole database is saved as a flat, pointer free file, all  */
+/* of it made of 32 bit words (in native byte order) and padded strings:     */
+/*                                                                           */
+/*  header                                                                   */
+/*  entity records:   id, name                                               */
+/*  relation records: name, rx count, then for every rx entry:               */
+/*                    rx entity id, tx count, tx entity ids                  */
+/*                                                                           */
+/* where a name is its length followed by its bytes, padded to a word.       */
+/* Relations and rx entries are in name order and tx ids are increasing, so  */
+/* loading (straight from the mapped file) builds every tree already         */
+/* balanced and every id set in one go. Entities keep their ids.             */
+/*****************************************************************************/
+#define SNAPSHOT_MAGIC "APINETS1"
+
+typedef struct snapshot_header_t_ {
+    char magic[8];
+    uint32_t ents_len;
+    uint32_t next_id;       // entity ids are in [0, next_id)
+    uint32_t rels_len;
+    uint32_t size;          // of the whole file, in bytes
+} snapshot_header_t;
+
+// Append a word
+void snapshot_put_u32(outbuf_t* buf, uint32_t value) {
+    outbuf_put(buf, (const char*) &value, sizeof(uint32_t));
+}
+
+// Append a name
+void snapshot_put_name(outbuf_t* buf, const char* handle) {
+    const intern_entry_t* entry = intern_entry_of(handle);
+    static const char padding[sizeof(uint32_t)] = { 0 };
+
+    snapshot_put_u32(buf, (uint32_t) entry->len);
+    outbuf_put(buf, entry->str, entry->len);
+    outbuf_put(buf, padding, (sizeof(uint32_t) - entry->len % sizeof(uint32_t)) % sizeof(uint32_t));
+}
+
+// Save database to file
+void snapshot_save(const char* path, const strtab_t* /* of entity_t */ entities,
+                   const bmap_t* /* of relinfo_t */ relations) {
+    outbuf_t buf;
+    outbuf_init(&buf);
+
+    snapshot_header_t header;
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+    header.ents_len = (uint32_t) entities->len;
+    header.next_id = (uint32_t) ent_registry.next_id;
+    header.rels_len = (uint32_t) relations->len;
+    header.size = 0;
+    outbuf_put(&buf, (const char*) &header, sizeof(header));
+
+    for (int i = 0; i < entities->cap; i++) {
+        const entity_t* entity = (const entity_t*) entities->slots[i].data;
+        if (entities->slots[i].key) {
+            snapshot_put_u32(&buf, (uint32_t) entity->id);
+            snapshot_put_name(&buf, entity->name);
         }
-        int txs_len = ((map_t*) (*node_to_remove_ref)->data)->len;
+    }
 
-        // Do actual removal of rx ent
-        map_node_t* node_to_remove = node_remove(node_to_remove_ref, rxs_map->comp);
+    for (bmap_iter_t rel_it = bmap_iter(relations); bmap_iter_next(&rel_it);) {
+        const bmap_t* rx_map = ((const relinfo_t*) rel_it.data)->rxing_ents_map;
 
-        if (node_to_remove) {
-            // Deallocate removed element
-            node_free(node_to_remove, rxs_map->free_key, rxs_map->free_element);
+        snapshot_put_name(&buf, rel_it.key);
+        snapshot_put_u32(&buf, (uint32_t) rx_map->len);
 
-            // Update map length
-            rxs_map->len--;
+        for (bmap_iter_t rx_it = bmap_iter(rx_map); bmap_iter_next(&rx_it);) {
+            const rxinfo_t* rx = (const rxinfo_t*) rx_it.data;
+            int* tx_ids = idset_members(&rx->txs);
 
-            //
-            if (relinfo_is_empty(relinfo)) {
-                node_free(node_remove(cur_ri_node_ref, relations->comp),
-                        relations->free_key,
-                        relations->free_element);
-                relations->len--;
-                return;
-            } else {
-                // Update amm cache with regard to the removed rx entity
-                int removal_res = map_inner_remove(relinfo->rxing_amounts_map,
-                        (const void*) (intptr_t) txs_len,
-                        to_remove);
-                assert(removal_res == MAP_OK);
-            }
+            snapshot_put_u32(&buf, (uint32_t) NOTNULL(ent_get((strtab_t*) entities, rx->name))->id);
+            snapshot_put_u32(&buf, (uint32_t) rx->txs.len);
+            outbuf_put(&buf, (const char*) tx_ids, sizeof(int) * rx->txs.len);
+
+            free(tx_ids);
         }
+    }
+
+    // Patch size in
+    header.size = (uint32_t) buf.len;
+    memcpy(buf.data, &header, sizeof(header));
+
+    FILE* out_f = fopen(path, "wb");
+    if (!out_f) ERROR("Could not open snapshot for writing\n");
+    outbuf_write(&buf, out_f);
+    if (fclose(out_f) != 0) ERROR("Could not write snapshot\n");
+
+    outbuf_destroy(&buf);
+}
+
+// Bounds checked cursor over a mapped snapshot
+typedef struct snapshot_cursor_t_ {
+    const char* ptr;
+    const char* end;
+} snapshot_cursor_t;
+
+// Consume len bytes, returning a pointer to them
+const void* snapshot_take(snapshot_cursor_t* cur, size_t len) {
+    if ((size_t) (cur->end - cur->ptr) < len) ERROR("Truncated snapshot\n");
+
+    const void* result = cur->ptr;
+    cur->ptr += len;
+    return result;
+}
 
+// Consume a word
+uint32_t snapshot_take_u32(snapshot_cursor_t* cur) {
+    uint32_t result;
+    memcpy(&result, snapshot_take(cur, sizeof(uint32_t)), sizeof(uint32_t));
+    return result;
+}
+
+// Consume a name
+slice_t snapshot_take_name(snapshot_cursor_t* cur) {
+    slice_t result;
+    result.len = snapshot_take_u32(cur);
+    result.ptr = snapshot_take(cur, result.len);
+    snapshot_take(cur, (sizeof(uint32_t) - result.len % sizeof(uint32_t)) % sizeof(uint32_t));
+    return result;
+}
+
+// Get loaded entity from an id read from a snapshot
+entity_t* snapshot_entity(uint32_t id) {
+    if (id >= (uint32_t) ent_registry.next_id || !ent_registry.by_id[id])
+        ERROR("Snapshot refers to an unknown entity\n");
+    return ent_registry.by_id[id];
+}
+
+// Incidence entry created while loading, attached to its entity at the end
+typedef struct snapshot_incid_t_ {
+    int ent_id;
+    const char* rel_id;
+    incid_t* incid;
+} snapshot_incid_t;
+
+// Loading state. Incidence maps are filled once everything is loaded, as building
+// them one edge at a time would cost more than all the rest
+typedef struct snapshot_loader_t_ {
+    snapshot_cursor_t cur;
+    incid_t** rel_incids;           // incidence of every entity in the current relation
+    int* touched;                   // entities with an entry in rel_incids
+    int touched_len;
+    snapshot_incid_t* incids;       // every incidence entry
+    int incids_len;
+    int incids_cap;
+    const void** keys;              // tree building storage
+    void** data;
+    int keys_cap;
+} snapshot_loader_t;
+
+// Make sure tree building storage can hold len elements
+void snapshot_reserve_keys(snapshot_loader_t* loader, int len) {
+    if (len > loader->keys_cap) {
+        loader->keys_cap = len;
+        loader->keys = realloc(loader->keys, sizeof(void*) * len);
+        loader->data = realloc(loader->data, sizeof(void*) * len);
+        if (!loader->keys || !loader->data) ERROR("Out of memory for snapshot loading\n");
     }
 }
-// Another helper function
-void ent_del_update_tx_and_amm(relinfo_t* relinfo, map_node_t** cur_txs_node_ref, const char* to_remove) {
-    NULLCHECK(relinfo);
 
-    map_node_t* cur_txs_node = *NOTNULL(cur_txs_node_ref);
-    map_t* amm_map = relinfo->rxing_amounts_map;
-    map_t* rxs_map = relinfo->rxing_ents_map;
+// Get incidence of entity in the relation being loaded, creating it if needed
+incid_t* snapshot_incid(snapshot_loader_t* loader, const entity_t* entity, const char* rel_id,
+                        relinfo_t* relinfo) {
+    incid_t* incid = loader->rel_incids[entity->id];
 
-    if (cur_txs_node) {
-        // Recursively walk the map
-        ent_del_update_tx_and_amm(relinfo, &(cur_txs_node->left), to_remove);
-        ent_del_update_tx_and_amm(relinfo, &(cur_txs_node->right), to_remove);
+    if (!incid) {
+        incid = incid_empty();
+        incid->relinfo = relinfo;
 
-        map_t* txs = (map_t*) cur_txs_node->data;
+        loader->rel_incids[entity->id] = incid;
+        loader->touched[loader->touched_len++] = entity->id;
 
-        // Attempt to remove tx ent
-        if (map_remove(txs, to_remove) == MAP_OK) {
-            // Update amm cache
-            int len = txs->len;
-            int removal_res = map_inner_remove(amm_map,
-                    (const void*) (intptr_t) (len + 1),
-                    cur_txs_node->key);
-            assert(removal_res == MAP_OK);
+        if (loader->incids_len == loader->incids_cap) {
+            loader->incids_cap = loader->incids_cap ? loader->incids_cap * 2 : 1024;
+            loader->incids = realloc(loader->incids, sizeof(snapshot_incid_t) * loader->incids_cap);
+            if (!loader->incids) ERROR("Out of memory for snapshot loading\n");
+        }
+        loader->incids[loader->incids_len++] = (snapshot_incid_t) { entity->id, rel_id, incid };
+    }
 
-            if (len > 0) {
-                int add_res = set_add(map_get_or(amm_map,
-                            (const void*) (intptr_t) len,
-                            &v_strset_empty),
-                        cur_txs_node->key);
-                assert(add_res == MAP_OK);
-            }
+    return incid;
+}
 
-            // Deallocate rx entry associated with empty tx set
-            if (len == 0) {
-                map_node_t* node_to_remove = node_remove(cur_txs_node_ref, rxs_map->comp);
-                rxs_map->len--;
-                assert(node_to_remove);
-                node_free(node_to_remove, rxs_map->free_key, rxs_map->free_element);
-            }
+// Load relation whose name was just consumed, returning it
+relinfo_t* snapshot_load_relinfo(snapshot_loader_t* loader, const char* rel_id) {
+    snapshot_cursor_t* cur = &(loader->cur);
+    relinfo_t* relinfo = relinfo_empty();
+
+    uint32_t rxs_len = snapshot_take_u32(cur);
+    if (rxs_len == 0 || rxs_len > (uint32_t) ent_registry.next_id) ERROR("Corrupted snapshot\n");
+    snapshot_reserve_keys(loader, (int) rxs_len);
+
+    for (uint32_t i = 0; i < rxs_len; i++) {
+        entity_t* rx_entity = snapshot_entity(snapshot_take_u32(cur));
+        uint32_t txs_len = snapshot_take_u32(cur);
+        const int* tx_ids = snapshot_take(cur, sizeof(int) * (size_t) txs_len);
+
+        if (txs_len == 0) ERROR("Snapshot holds an empty tx set\n");
+        if (i > 0 && handlecmp(loader->keys[i - 1], rx_entity->name) >= 0)
+            ERROR("Snapshot rx entries out of order\n");
+
+        rxinfo_t* rx = rxinfo_empty();
+        rx->name = rx_entity->name;
+
+        for (uint32_t t = 0; t < txs_len; t++) {
+            if (t > 0 && tx_ids[t - 1] >= tx_ids[t]) ERROR("Snapshot tx ids out of order\n");
+            entity_t* tx_entity = snapshot_entity((uint32_t) tx_ids[t]);
+            idset_add(&snapshot_incid(loader, tx_entity, rel_id, relinfo)->rxs, rx_entity->id);
         }
+        snapshot_incid(loader, rx_entity, rel_id, relinfo)->is_rx = 1;
+
+        idset_fill_sorted(&rx->txs, tx_ids, (int) txs_len);
+        amounts_move(&(relinfo->rxing_amounts), rx, 0, (int) txs_len);
+
+        loader->keys[i] = rx->name;
+        loader->data[i] = rx;
     }
+
+    bmap_fill_sorted(relinfo->rxing_ents_map, loader->keys, loader->data, (int) rxs_len);
+
+    // Next relation starts with no incidence
+    for (int i = 0; i < loader->touched_len; i++)
+        loader->rel_incids[loader->touched[i]] = NULL;
+    loader->touched_len = 0;
+
+    return relinfo;
 }
 
+// Order incidence entries by entity, then as incidence maps do (qsort style)
+int snapshot_incid_cmp(const void* lhs_v, const void* rhs_v) {
+    const snapshot_incid_t* lhs = (const snapshot_incid_t*) lhs_v;
+    const snapshot_incid_t* rhs = (const snapshot_incid_t*) rhs_v;
 
-// TODO: implement this with currying (see above)
-/************************************************************************************/
-/* // Removes relation from database                                                */
-/* void rel_del(map_t* * of relinfo_t *\/ relations,                                */
-/*              const char* txing_ent, const char* rxing_ent, const char* rel_id) { */
-/*     void do_it(map_t* map, const void* key) {                                    */
-/*         rel_del_no_cleanup(map, txing_ent, rxing_ent, (const char*) key);        */
-/*     }                                                                            */
-/*                                                                                  */
-/*     do_then_cleanup(&do_it, &relinfo_is_empty, &relinfo_vfree);                  */
-/* }                                                                                */
-/*                                                                                  */
-/************************************************************************************/
+    if (lhs->ent_id != rhs->ent_id)
+        return lhs->ent_id < rhs->ent_id ? -1 : 1;
+    return ptrcmp(lhs->rel_id, rhs->rel_id);
+}
 
-/******************/
-/* Report command */
-/******************/
-void report_string_printer(FILE* out_f, const void* str) {
-    fprintf(out_f, "\"%s\" ", (const char*) str);
+// Fill incidence maps of every entity with the entries created while loading
+void snapshot_attach_incids(snapshot_loader_t* loader) {
+    if (loader->incids_len == 0) return;
+    qsort(loader->incids, loader->incids_len, sizeof(snapshot_incid_t), &snapshot_incid_cmp);
+
+    for (int i = 0; i < loader->incids_len;) {
+        int ent_id = loader->incids[i].ent_id;
+
+        int len = 0;
+        while (i + len < loader->incids_len && loader->incids[i + len].ent_id == ent_id)
+            len++;
+
+        snapshot_reserve_keys(loader, len);
+        for (int j = 0; j < len; j++) {
+            loader->keys[j] = loader->incids[i + j].rel_id;
+            loader->data[j] = loader->incids[i + j].incid;
+        }
+        map_fill_sorted(ent_incidence(ent_registry.by_id[ent_id]), loader->keys, loader->data, len);
+
+        i += len;
+    }
+}
+
+// Replace database with the content of a snapshot file
+strtab_t* initialize_entities();
+bmap_t* initialize_relations();
+void snapshot_load(const char* path, strtab_t** /* of entity_t */ entities, bmap_t** /* of relinfo_t */ relations) {
+    int fd = open(path, O_RDONLY);
+    struct stat snap_stat;
+    if (fd < 0 || fstat(fd, &snap_stat) != 0) ERROR("Could not open snapshot\n");
+    if ((size_t) snap_stat.st_size < sizeof(snapshot_header_t)) ERROR("Truncated snapshot\n");
+
+    size_t size = (size_t) snap_stat.st_size;
+    const char* mapped = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (mapped == MAP_FAILED) ERROR("Could not map snapshot\n");
+    close(fd);
+
+    snapshot_loader_t loader;
+    memset(&loader, 0, sizeof(loader));
+    loader.cur = (snapshot_cursor_t) { mapped, mapped + size };
+
+    snapshot_header_t header;
+    memcpy(&header, snapshot_take(&(loader.cur), sizeof(header)), sizeof(header));
+    if (memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic)) != 0) ERROR("Not a snapshot\n");
+    if (header.size != size) ERROR("Truncated snapshot\n");
+    if (header.next_id > INT32_MAX || header.ents_len > header.next_id) ERROR("Corrupted snapshot\n");
+
+    // Drop current database
+    bmap_free(*relations);
+    strtab_free(*entities);
+    ent_registry_free();
+    *entities = initialize_entities();
+    *relations = initialize_relations();
+
+    // Entities
+    ent_registry_restore((int) header.next_id);
+    for (uint32_t i = 0; i < header.ents_len; i++) {
+        uint32_t id = snapshot_take_u32(&(loader.cur));
+        const char* name = intern_acquire(snapshot_take_name(&(loader.cur)));
+
+        if (id >= header.next_id || ent_registry.by_id[id]) ERROR("Corrupted snapshot\n");
+        entity_t* entity = entity_at((int) id);
+        entity->name = name;
+        if (strtab_add(*entities, name, handle_hash(name), entity) != MAP_OK)
+            ERROR("Snapshot holds duplicate entities\n");
+
+        intern_release(name);
+    }
+    ent_registry_collect_free();
+
+    // Relations
+    loader.rel_incids = calloc(header.next_id + 1, sizeof(incid_t*));
+    loader.touched = malloc(sizeof(int) * (header.next_id + 1));
+    const void** rel_keys = malloc(sizeof(void*) * (header.rels_len + 1));
+    void** rel_data = malloc(sizeof(void*) * (header.rels_len + 1));
+    if (!loader.rel_incids || !loader.touched || !rel_keys || !rel_data)
+        ERROR("Out of memory for snapshot loading\n");
+
+    for (uint32_t i = 0; i < header.rels_len; i++) {
+        const char* rel_id = intern_acquire(snapshot_take_name(&(loader.cur)));
+        if (i > 0 && handlecmp(rel_keys[i - 1], rel_id) >= 0) ERROR("Snapshot relations out of order\n");
+
+        rel_keys[i] = rel_id;
+        rel_data[i] = snapshot_load_relinfo(&loader, rel_id);
+    }
+    if (loader.cur.ptr != loader.cur.end) ERROR("Corrupted snapshot\n");
+
+    bmap_fill_sorted(*relations, rel_keys, rel_data, (int) header.rels_len);
+    snapshot_attach_incids(&loader);
+
+    // The relations map and incidence maps hold their own references now
+    for (uint32_t i = 0; i < header.rels_len; i++)
+        intern_release(rel_keys[i]);
+
+    free(rel_keys);
+    free(rel_data);
+    free(loader.rel_incids);
+    free(loader.touched);
+    free(loader.incids);
+    free(loader.keys);
+    free(loader.data);
+    munmap((void*) mapped, size);
 }
 
-void report_relinfo_printer(FILE* out_f, const void* relinfo) {
-    map_node_t* max_node =
-        map_get_max_node(((relinfo_t*) relinfo)->rxing_amounts_map);
+// Get path argument of a command. Result is allocated and owned by the caller
+char* scan_path(slice_t token) {
+    slice_t path = scan_id(token);
 
-    // Empty rx sets are not allowed
-    assert(max_node);
+    char* result = malloc(path.len + 1);
+    if (!result) ERROR("Out of memory for path\n");
+    memcpy(result, path.ptr, path.len);
+    result[path.len] = '\0';
 
-    int txs_num = (int) (intptr_t) max_node->key;
-    map_t* rxs = (map_t*) max_node->data;
+    return result;
+}
 
-    set_print_with(out_f, rxs, &report_string_printer, PRINT_MODE_CUSTOM);
+/*****************************************************************************/
+/* Trace compactor. With the "compact" option commands are applied as usual, */
+/* but instead of report output the program writes an equivalent command     */
+/* log: replaying it gives the same report output at every report point.     */
+/* The log leads a shadow database from one reported state to the next,     */
+/* touching only the edges (and entities) updated since the previous report, */
+/* so updates cancelling out, updates on missing entities and repeated       */
+/* addent leave nothing behind.                                              */
+/*****************************************************************************/
+// Edge updated since the last report (references to its handles are held)
+typedef struct compact_edge_t_ {
+    const char* tx;
+    const char* rx;
+    const char* rel_id;
+} compact_edge_t;
+
+typedef struct compactor_t_ {
+    strtab_t* entities;     // shadow database: state replaying the log leads to
+    bmap_t* relations;
+    compact_edge_t* edges;  // edges updated since the last report
+    int edges_len;
+    int edges_cap;
+    const char** deleted;   // entities deleted since the last report
+    int deleted_len;
+    int deleted_cap;
+    outbuf_t out;
+} compactor_t;
+
+// Compactor of the running program, NULL unless compacting
+compactor_t* compactor = NULL;
+
+strtab_t* initialize_entities();
+bmap_t* initialize_relations();
+compactor_t* compactor_new() {
+    compactor_t* result = calloc(1, sizeof(compactor_t));
+    if (!result) ERROR("Out of memory for compactor\n");
+
+    result->entities = initialize_entities();
+    result->relations = initialize_relations();
+    outbuf_init(&(result->out));
 
-    fprintf(out_f, "%d; ", txs_num);
+    return result;
 }
 
-void report(FILE* out_f, const map_t* /* of relinfo_t */ relations) {
-    if (relations->len == 0) {
-        fputs("none\n", out_f);
-    } else  {
-        map_print_with(out_f, relations, 
-                &report_string_printer, 
-                &report_relinfo_printer,
-                PRINT_MODE_CUSTOM);
-        fputs("\n", out_f);
+// Record an edge update (handles are expected to be interned)
+void compactor_edge_push(compactor_t* comp, const char* tx, const char* rx, const char* rel_id) {
+    if (comp->edges_len == comp->edges_cap) {
+        comp->edges_cap = comp->edges_cap ? comp->edges_cap * 2 : 256;
+        comp->edges = realloc(comp->edges, sizeof(compact_edge_t) * comp->edges_cap);
+        if (!comp->edges) ERROR("Out of memory for compactor\n");
     }
+
+    comp->edges[comp->edges_len++] = (compact_edge_t) {
+        intern_ref(tx), intern_ref(rx), intern_ref(rel_id)
+    };
 }
 
-/**********************************************/
-/* Helper functions for handling program flow */
-/**********************************************/
-// Config constants
-#define DEBUG_ON  0
-#define DEBUG_OFF 1
+// Record an entity deletion
+void compactor_ent_del(compactor_t* comp, const char* name) {
+    if (comp->deleted_len == comp->deleted_cap) {
+        comp->deleted_cap = comp->deleted_cap ? comp->deleted_cap * 2 : 64;
+        comp->deleted = realloc(comp->deleted, sizeof(const char*) * comp->deleted_cap);
+        if (!comp->deleted) ERROR("Out of memory for compactor\n");
+    }
 
-// Entity config constants
-#define ID_SCAN_BUF 512
+    comp->deleted[comp->deleted_len++] = intern_ref(name);
+}
 
-// Configure progam
-void configure(int argc, char** argv, FILE** in_f, FILE** out_f, int* debug_mode) {
-    // Set input file
-    if (argc > 1) *in_f = fopen(argv[1], "r");
-    else *in_f = stdin;
+// 1 if the database holds the given edge, 0 otherwise
+int compact_edge_present(strtab_t* /* of entity_t */ entities, bmap_t* /* of relinfo_t */ relations,
+                         const compact_edge_t* edge) {
+    entity_t* tx_entity = ent_get(entities, edge->tx);
+    entity_t* rx_entity = ent_get(entities, edge->rx);
+    relinfo_t* relinfo = (relinfo_t*) bmap_get(relations, edge->rel_id);
+    if (!tx_entity || !rx_entity || !relinfo) {
+        return 0;
+    }
 
-    // Set output file
-    if (argc > 2) *out_f = fopen(argv[2], "w");
-    else *out_f = stdout;
+    rxinfo_t* rx = (rxinfo_t*) bmap_get(relinfo->rxing_ents_map, edge->rx);
 
-    // Set debug mode
-    if (argc > 3 && strcmp(argv[3], "db") == 0) *debug_mode = DEBUG_OFF;
-    else *debug_mode = DEBUG_ON;
+    return rx && idset_contains(&rx->txs, tx_entity->id);
 }
 
-// Scan string used for entity and relation ids
-char* scan_id(FILE* in_f, int reset) {
-    static int index = 0;
-    static char buf[ID_SCAN_BUF];
+// Append a command with its (quoted) arguments to the log
+void compactor_put_command(compactor_t* comp, const char* command, const char** args, int args_len) {
+    outbuf_put(&(comp->out), command, strlen(command));
+    for (int i = 0; i < args_len; i++) {
+        outbuf_putc(&(comp->out), ' ');
+        outbuf_put_quoted(&(comp->out), args[i]);
+        comp->out.len--;    // drop the space following the quoted name
+    }
+    outbuf_putc(&(comp->out), '\n');
+}
 
-    if (reset)  {
-        index = 0;
+// Make sure the shadow database holds an entity, logging its addent if needed
+void compactor_ent_ensure(compactor_t* comp, const char* name) {
+    if (!ent_get(comp->entities, name)) {
+        ent_add(comp->entities, name);
+        compactor_put_command(comp, "addent", &name, 1);
     }
+}
 
-    char* out = buf + index;
+// Bring a deleted entity up to date in the shadow database, either with a delent
+// or with a delrel for every stale edge of it, whichever makes the shorter log.
+// Edges it has now were all updated after its deletion, so they are logged anyway
+void compactor_flush_deleted(compactor_t* comp, strtab_t* /* of entity_t */ entities,
+                             bmap_t* /* of relinfo_t */ relations, const char* name) {
+    entity_t* shadow_entity = ent_get(comp->entities, name);
+    if (!shadow_entity) {
+        return;
+    }
 
-    fscanf(in_f, "%s", out);
+    // Gather edges of the shadow entity which are gone from the database
+    int first_stale = comp->edges_len;
+    int kept = 0;
+    for (map_iter_t it = map_iter(ent_incidence(shadow_entity)); map_iter_next(&it);) {
+        const char* rel_id = it.cur->key;
+        incid_t* incid = (incid_t*) it.cur->data;
+        compact_edge_t edge = { name, NULL, rel_id };
+
+        int* rx_ids = idset_members(&incid->rxs);
+        for (int i = 0; i < incid->rxs.len; i++) {
+            edge.rx = entity_of_id(rx_ids[i])->name;
+            if (compact_edge_present(entities, relations, &edge)) kept++;
+            else compactor_edge_push(comp, edge.tx, edge.rx, edge.rel_id);
+        }
+        free(rx_ids);
 
-    // Check validity
-    size_t len = strlen(out);
-    assert(len >= 2);
+        if (incid->is_rx) {
+            rxinfo_t* rx = (rxinfo_t*) NOTNULL(bmap_get(incid->relinfo->rxing_ents_map, name));
 
-    // Remove "(s)
-    out[len - 1] = '\0';
+            edge.rx = name;
+            int* tx_ids = idset_members(&rx->txs);
+            for (int i = 0; i < rx->txs.len; i++) {
+                edge.tx = entity_of_id(tx_ids[i])->name;
+                if (compact_edge_present(entities, relations, &edge)) kept++;
+                else compactor_edge_push(comp, edge.tx, edge.rx, edge.rel_id);
+            }
+            free(tx_ids);
+        }
+    }
 
-    index += (len + 1);
+    // A delent costs one command, plus adding back the entity and the edges it keeps
+    int stale = comp->edges_len - first_stale;
+    if (stale > 1 + kept + (kept > 0)) {
+        for (int i = first_stale; i < comp->edges_len; i++) {
+            intern_release(comp->edges[i].tx);
+            intern_release(comp->edges[i].rx);
+            intern_release(comp->edges[i].rel_id);
+        }
+        comp->edges_len = first_stale;
 
-    return out + 1;
+        ent_del(comp->entities, comp->relations, name);
+        compactor_put_command(comp, "delent", &name, 1);
+    }
 }
 
-// Initialize empty entity storage
-map_t* initialize_entities() {
-    return strset_empty();
+// Log the updates leading the shadow database to the current state, then the given
+// query (a report or a rank)
+void compactor_query(compactor_t* comp, FILE* out_f,
+                     strtab_t* /* of entity_t */ entities, bmap_t* /* of relinfo_t */ relations,
+                     const char* command, const char** args, int args_len) {
+    for (int i = 0; i < comp->deleted_len; i++) {
+        compactor_flush_deleted(comp, entities, relations, comp->deleted[i]);
+        intern_release(comp->deleted[i]);
+    }
+    comp->deleted_len = 0;
+
+    // An edge may have been updated many times, only its final state is compared
+    for (int i = 0; i < comp->edges_len; i++) {
+        compact_edge_t* edge = &(comp->edges[i]);
+        int present = compact_edge_present(entities, relations, edge);
+
+        if (present != compact_edge_present(comp->entities, comp->relations, edge)) {
+            if (present) {
+                compactor_ent_ensure(comp, edge->tx);
+                compactor_ent_ensure(comp, edge->rx);
+                rel_add(comp->entities, comp->relations, edge->tx, edge->rx, edge->rel_id);
+            } else {
+                rel_del(comp->entities, comp->relations, edge->tx, edge->rx, edge->rel_id);
+            }
+            const char* args[] = { edge->tx, edge->rx, edge->rel_id };
+            compactor_put_command(comp, present ? "addrel" : "delrel", args, 3);
+        }
+
+        intern_release(edge->tx);
+        intern_release(edge->rx);
+        intern_release(edge->rel_id);
+    }
+    comp->edges_len = 0;
+
+    compactor_put_command(comp, command, args, args_len);
+    output_write(&(comp->out), out_f);
+    comp->out.len = 0;
 }
 
-// Initialize empty relations storage
-map_t* initialize_relations() {
-    return map_empty(&strcomp, &str_cloner, &disallow_duplicates, &free, &relinfo_free);
+void compactor_free(compactor_t* comp) {
+    if (!comp) {
+        return;
+    }
+
+    for (int i = 0; i < comp->edges_len; i++) {
+        intern_release(comp->edges[i].tx);
+        intern_release(comp->edges[i].rx);
+        intern_release(comp->edges[i].rel_id);
+    }
+    for (int i = 0; i < comp->deleted_len; i++) {
+        intern_release(comp->deleted[i]);
+    }
+
+    strtab_free(comp->entities);
+    bmap_free(comp->relations);
+    free(comp->edges);
+    free(comp->deleted);
+    outbuf_destroy(&(comp->out));
+    free(comp);
 }
 
 /********/
@@ -943,89 +5355,227 @@ int main(int argc, char** argv) {
     // Configure program
     FILE* in_f;
     FILE* out_f;
-    int debug_mode;
-    configure(argc, argv, &in_f, &out_f, &debug_mode);
+    config_t config;
+    configure(argc, argv, &in_f, &out_f, &config);
+
+    // Initialize input
+    reader_t reader;
+    reader_init(&reader, in_f);
 
     // Initialize apinet storage
-    map_t* entities = initialize_entities();
-    map_t* relations = initialize_relations();
+    initialize_intern_pool();
+    initialize_cmd_heads();
+    strtab_t* entities = initialize_entities();
+    bmap_t* relations = initialize_relations();
+    if (config.threads > 1) render_pool = render_pool_new(config.threads);
+    engine_t* engine = config.shards ? engine_new(config.shards) : NULL;
+    if (config.load) snapshot_load(config.load, &entities, &relations);
+    if (config.compact_mode) compactor = compactor_new();
+    if (config.lazy_delete) purger = ent_purger_new();
+    if (config.pipeline) {
+        writer = writer_new(out_f);
+        atexit(&writer_exit);
+    }
+    pipeline_t* pipeline = config.pipeline ? pipeline_new(&reader) : NULL;
+
+    // User interaction loop (ends with input too)
+    BENCH_BEGIN();
+    cmd_t cmd;
+    while (cmd_next(pipeline, &reader, &cmd)) {
+        BENCH_CMD_START();
+        STATS_CMD_START();
+
+        // Purge a few edges of dead entities along with every command
+        if (purger) ent_purge(purger, relations, PURGE_STEP_EDGES);
 
-    // User interaction loop
-    char command[1024];
-    while (1) {
         // Read head of command from user
-        fscanf(in_f, "%s", command);
+        slice_t command = cmd.head;
 
         // Process head of command
-        if (strcmp(command, "addent") == 0) {
+        if (cmd.kind == CMD_ADDENT) {
             // Parse second command argument as entity name
-            char* to_add = scan_id(in_f, 1);
+            const char* to_add = intern_acquire(scan_id(cmd.args[0]));
+
+            // Add entity to map (a dead one with the same name must be gone first)
+            if (purger) ent_purge_name(purger, relations, to_add);
+            ent_add(entities, to_add);
 
-            // Add entity to map
-            set_add(entities, (const void*) to_add);
+            intern_release(to_add);
 
-        } else if (strcmp(command, "delent") == 0) {
+        } else if (cmd.kind == CMD_DELENT) {
             // Get name of entity to remove from first command argument
-            char* to_remove = scan_id(in_f, 1);
+            //  NB. an id which is not interned can't be stored anywhere
+            const char* to_remove = intern_ref(intern_find(scan_id(cmd.args[0])));
+
+            if (to_remove && compactor) compactor_ent_del(compactor, to_remove);
+
+            // Perform removal (pending relation updates may involve the entity)
+            if (to_remove && engine) {
+                engine_ent_del(engine, entities, to_remove);
+            } else if (to_remove) {
+                relbatch_flush(&rel_batch, relations);
+                if (purger) ent_del_lazy(purger, entities, to_remove);
+                else        ent_del(entities, relations, to_remove);
+            }
 
-            // Perform removal
-            ent_del(entities, relations, to_remove);
+            intern_release(to_remove);
 
-        } else if (strcmp(command, "addrel") == 0) {
+        } else if (cmd.kind == CMD_ADDREL) {
             // Get name of txing entity
-            char* txing_ent = scan_id(in_f, 1);
+            const char* txing_ent = intern_ref(intern_find(scan_id(cmd.args[0])));
 
             // Get name of rxing entity
-            char* rxing_ent = scan_id(in_f, 0);
+            const char* rxing_ent = intern_ref(intern_find(scan_id(cmd.args[1])));
 
             // Get name of relation
-            char* relation = scan_id(in_f, 0);
+            const char* relation = intern_acquire(scan_id(cmd.args[2]));
+
+            // Add relation (entities which are not interned do not exist)
+            if (txing_ent && rxing_ent) {
+                if (compactor)
+                    compactor_edge_push(compactor, txing_ent, rxing_ent, relation);
+
+                if (engine)
+                    engine_rel_update(engine, entities, txing_ent, rxing_ent, relation, 1);
+                else if (config.batch_mode)
+                    relbatch_push(&rel_batch, entities, txing_ent, rxing_ent, relation, 1);
+                else
+                    rel_add(entities, relations, txing_ent, rxing_ent, relation);
+            }
 
-            // Add relation
-            rel_add(entities, relations, txing_ent, rxing_ent, relation);
+            intern_release(txing_ent);
+            intern_release(rxing_ent);
+            intern_release(relation);
 
-        } else if (strcmp(command, "delrel") == 0) {
+        } else if (cmd.kind == CMD_DELREL) {
             // Get name of txing entity
-            char* txing_ent = scan_id(in_f, 1);
+            const char* txing_ent = intern_ref(intern_find(scan_id(cmd.args[0])));
 
             // Get name of rxing entity
-            char* rxing_ent = scan_id(in_f, 0);
+            const char* rxing_ent = intern_ref(intern_find(scan_id(cmd.args[1])));
 
             // Get name of relation
-            char* relation = scan_id(in_f, 0);
+            const char* relation = intern_ref(intern_find(scan_id(cmd.args[2])));
+
+            // Remove relation
+            if (txing_ent && rxing_ent && relation) {
+                if (compactor)
+                    compactor_edge_push(compactor, txing_ent, rxing_ent, relation);
+
+                if (engine)
+                    engine_rel_update(engine, entities, txing_ent, rxing_ent, relation, 0);
+                else if (config.batch_mode)
+                    relbatch_push(&rel_batch, entities, txing_ent, rxing_ent, relation, 0);
+                else
+                    rel_del(entities, relations, txing_ent, rxing_ent, relation);
+            }
+
+            intern_release(txing_ent);
+            intern_release(rxing_ent);
+            intern_release(relation);
 
-            // Add relation
-            rel_del(relations, txing_ent, rxing_ent, relation);
+        } else if (cmd.kind == CMD_SAVE || cmd.kind == CMD_LOAD) {
+            char* path = scan_path(cmd.args[0]);
 
-        } else if (strcmp(command, "report") == 0) {
-            report(out_f, relations);
+            if (engine) ERROR("Snapshots are not supported with shards\n");
+            if (compactor) ERROR("Snapshots are not supported when compacting\n");
+            relbatch_flush(&rel_batch, relations);
+            ent_purge_all(purger, relations);
 
-        // Debug mode only commands
-        } else if (debug_mode == DEBUG_ON) {
-            if (strcmp(command, "gent") == 0) {
+            if (cmd.kind == CMD_SAVE) snapshot_save(path, entities, relations);
+            else                           snapshot_load(path, &entities, &relations);
+
+            free(path);
+
+        } else if (cmd.kind == CMD_REPORT) {
+            // Optional argument asks for the top k rx ents of every relation
+            slice_t top_arg = cmd.args[0];
+            int top_k = top_arg.len ? slice_to_count(top_arg) : 0;
+
+            if (engine) {
+                if (top_k) engine_report_top(engine, out_f, top_k);
+                else       engine_report(engine, out_f);
+            } else {
+                relbatch_flush(&rel_batch, relations);
+                ent_purge_all(purger, relations);
+                if (compactor) {
+                    char query[32];
+                    snprintf(query, sizeof(query), top_k ? "report %d" : "report", top_k);
+                    compactor_query(compactor, out_f, entities, relations, query, NULL, 0);
+                } else if (top_k) {
+                    report_top(out_f, &relations, 1, top_k);
+                } else {
+                    report(out_f, relations);
+                }
+            }
+
+        } else if (cmd.kind == CMD_RANK) {
+            // Ids are interned for the duration of the query, even if nothing holds them
+            const char* rxing_ent = intern_acquire(scan_id(cmd.args[0]));
+            const char* relation = intern_acquire(scan_id(cmd.args[1]));
+
+            if (engine) {
+                engine_report_rank(engine, out_f, rxing_ent, relation);
+            } else {
+                relbatch_flush(&rel_batch, relations);
+                ent_purge_all(purger, relations);
+                if (compactor) {
+                    const char* args[] = { rxing_ent, relation };
+                    compactor_query(compactor, out_f, entities, relations, "rank", args, 2);
+                } else {
+                    report_rank(out_f, relations, rxing_ent, relation);
+                }
+            }
+
+            intern_release(rxing_ent);
+            intern_release(relation);
+
+        // Debug output is not part of the compacted log
+        } else if (compactor && (cmd.kind == CMD_GENT || cmd.kind == CMD_PENT ||
+                                 cmd.kind == CMD_PREL || cmd.kind == CMD_STATS)) {
+
+        // Debug mode only commands (written straight to the output)
+        } else if (config.debug_mode == DEBUG_ON) {
+            if (writer) writer_drain(writer);
+
+            if (cmd.kind == CMD_GENT) {
                 // Retrieve string to get
-                char to_get[ID_SCAN_BUF];
-                fscanf(in_f, "%s", to_get);
+                const char* to_get = intern_find(cmd.args[0]);
 
                 // Get it
-                void* result = map_get(entities, (void*) to_get);
+                entity_t* result = to_get ? ent_get(entities, to_get) : NULL;
 
                 // Print the result as a string if present
                 if (result == NULL)
                     puts("NOT PRESENT!");
                 else 
-                    puts((const char*) result);
-
-            } else if (strcmp(command, "pent") == 0) {
-                map_db_print(out_f, entities);
-                fprintf(out_f, "\n");
+                    puts(result->name);
 
-            } else if (strcmp(command, "prel") == 0) {
-                map_print_with(out_f, relations, &str_printer,
-                        &relinfo_print, PRINT_MODE_DB);
+            } else if (cmd.kind == CMD_PENT) {
+                strtab_print_with(out_f, entities, &str_printer, &entity_printer, PRINT_MODE_DB);
                 fprintf(out_f, "\n");
 
-            } else if (strcmp(command, "end") == 0) {
+            } else if (cmd.kind == CMD_PREL) {
+                if (engine) {
+                    engine_print_relations(engine, out_f);
+                } else {
+                    relbatch_flush(&rel_batch, relations);
+                    ent_purge_all(purger, relations);
+                    bmap_print_with(out_f, relations, &str_printer,
+                            &relinfo_print, PRINT_MODE_DB);
+                    fprintf(out_f, "\n");
+                }
+
+            } else if (cmd.kind == CMD_STATS) {
+                if (engine) {
+                    engine_stats_print(engine, out_f, entities);
+                } else {
+                    relbatch_flush(&rel_batch, relations);
+                    ent_purge_all(purger, relations);
+                    stats_print(out_f, entities, &relations, 1);
+                }
+
+            } else if (cmd.kind == CMD_END) {
                 break;
 
             } else {
@@ -1033,18 +5583,36 @@ int main(int argc, char** argv) {
             }
         } else {
 invalid_command: {
-                     printf("Unrecognized command: %s", command);
+                     if (writer) writer_drain(writer);
+                     printf("Unrecognized command: %.*s", (int) command.len, command.ptr);
                      exit(EXIT_FAILURE);
                  }
         }
 
+        STATS_CMD_STOP(command);
+        BENCH_CMD_STOP(command);
     }
-
-    // Deallocate entity map
-    map_free(entities);
-    map_free(relations);
+    BENCH_END();
+
+    // Stop reading, and write what's left
+    pipeline_free(pipeline);
+    writer_exit();
+
+    // Deallocate entity map (shards go first, they may still be working)
+    engine_free(engine);
+    relbatch_destroy(&rel_batch);
+    compactor_free(compactor);
+    ent_purger_free(purger);
+    strtab_free(entities);
+    bmap_free(relations);
+    strtab_free(intern_pool);
+    ent_registry_free();
+    outbuf_destroy(&report_buf);
+    render_pool_free(render_pool);
+    slab_release_all();
 
     // Close streams if necessary
+    reader_close(&reader);
     if (in_f != stdin)   fclose(in_f);
     if (out_f != stdout) fclose(out_f);
 